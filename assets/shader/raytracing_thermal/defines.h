@@ -27,6 +27,8 @@
 #define GLSL_GLOBAL_AREA_DATA_BINDING           12
 #define GLSL_GLOBAL_EMISSION_DATA_BINDING       13
 #define GLSL_GLOBAL_ABSORPTION_DATA_BINDING     14
+#define GLSL_GLOBAL_TRIANGLE_DATA_BINDING       15
+#define GLSL_GLOBAL_TRIANGLE_RAY_DATA_BINDING   16
 
 #ifdef GLSL
 #define M_PI 3.14159265358979323846264338327950288f
@@ -93,8 +95,20 @@ STRUCT(
     UINT    (batchSeed)
     FLOAT   (clipDistance)
     BOOL    (backfaceCulling) //
+    UINT    (sampler) // TRANSPORT_SAMPLER_*
 , AuxiliaryUbo)
 
+// per launch, all launches of a transport segment are recorded into one command buffer
+STRUCT(
+    UINT    (triangleOffset) // first triangle of the launch
+    UINT    (batchSeed)
+    UINT    (batchIndex) // batches since the sample offsets were uploaded
+, TransportPushConstants)
+
+// transport sampler
+#define TRANSPORT_SAMPLER_RANDOM 0
+#define TRANSPORT_SAMPLER_SOBOL 1
+
 // instance
 STRUCT(
     MAT4    (model_matrix)
@@ -117,15 +131,35 @@ STRUCT(
     VEC4    (baseColorFactor)
     FLOAT   (alphaCutoff)
     UINT    (triangleCount)
-    INT     (aligned1)
+    UINT    (triangleOffset) // global index of the first triangle
     INT     (aligned2)
 , GeometrySSBO)
 
+// triangle, flat lookup of the global triangle index used by the transport launch
+STRUCT(
+    UINT    (vertex0)
+    UINT    (vertex1)
+    UINT    (vertex2)
+    UINT    (instance)
+, TriangleSSBO)
+
+// per triangle ray budget of the transport launch
+STRUCT(
+    UINT    (rayCount)
+    UINT    (sampleOffset) // rays traced before the upload, later batches continue the sobol sequence from here
+, TriangleRaysSSBO)
+
 // geometry
 STRUCT(
     VEC4(factor)
 , TransportFactor)
 
+// transport record, one per absorbed ray
+STRUCT(
+    UINT    (emitterTriangle)
+    UINT    (absorberTriangle)
+, TransportRecord)
+
 // punctual lights
 // type
 #define LIGHT_TYPE_DIRECTIONAL 0
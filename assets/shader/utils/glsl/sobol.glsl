@@ -0,0 +1,48 @@
+#ifndef SOBOL_GLSL
+#define SOBOL_GLSL 1
+
+// Owen-scrambled Sobol points in 2D, the first two Sobol dimensions form a (0,2)-sequence:
+// every aligned power of two block of consecutive indices has one point in each elementary interval (stratified)
+// higher dimensions are padded with independently scrambled 2D sequences, the index is shuffled per seed (padding without
+// shuffling would correlate all blocks of a sample through their shared index)
+// Burley, Practical Hash-based Owen Scrambling, JCGT 2020: https://jcgt.org/published/0009/04/01/
+
+uint laineKarrasPermutation(uint x, const uint seed)
+{
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+uint nestedUniformScramble(const uint x, const uint seed)
+{
+	return bitfieldReverse(laineKarrasPermutation(bitfieldReverse(x), seed));
+}
+
+uint hashCombine(const uint seed, const uint v)
+{
+	return seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+// van der Corput and the second Sobol dimension (direction numbers v_k+1 = v_k ^ (v_k >> 1))
+uvec2 sobol2D(uint index)
+{
+	uvec2 result = uvec2(bitfieldReverse(index), 0u);
+	for (uint v = 1u << 31; index != 0u; index >>= 1, v ^= v >> 1)
+		if ((index & 1u) != 0u)
+			result.y ^= v;
+	return result;
+}
+
+// in [0, 1), 24 bits per component
+vec2 sobolOwen2D(const uint index, const uint seed)
+{
+	const uvec2 s = sobol2D(nestedUniformScramble(index, seed));
+	const uvec2 scrambled = uvec2(nestedUniformScramble(s.x, hashCombine(seed, 0u)), nestedUniformScramble(s.y, hashCombine(seed, 1u)));
+	return vec2(scrambled >> 8) * (1.0f / 16777216.0f);
+}
+
+#endif
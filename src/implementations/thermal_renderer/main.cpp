@@ -461,6 +461,10 @@ int main(int argc, char* argv[]) {
 	double timestep = 0.0f;
 	app.add_option("--timestep", timestep, "Timestep (h)");
 
+	std::string transport_cache = "./cache/transport";
+	app.add_option("--transport-cache", transport_cache,
+		"Directory of the transport matrix cache, empty to disable");
+
 	bool debug = false;
 	app.add_flag("--verbose", debug, "Be verbose.");
 
@@ -518,6 +522,7 @@ int main(int argc, char* argv[]) {
 	ThermalRenderer* lib_impl = static_cast<ThermalRenderer*>(tamashii::findBackendImplementation(THERMAL_RENDERER_NAME));
 	lib_impl->setRayBatchCount(rays_per_triangle, 1);
 	lib_impl->temporaryDisableTransportCompute();
+	lib_impl->setTransportCache(!transport_cache.empty(), transport_cache);
 
 	tamashii::EventSystem& es = tamashii::EventSystem::getInstance();
 	es.setCallback(tamashii::EventType::ACTION, tamashii::Input::A_OPEN_SCENE, [=](const tamashii::Event& aEvent)
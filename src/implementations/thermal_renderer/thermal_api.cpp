@@ -482,6 +482,100 @@ extern "C" int simulate(
 	return 0;
 }
 
+extern "C" int simulate_adaptive(
+	float* _output_times_hours,
+	unsigned int _output_count,
+	float* _vertex_temperatures,
+	unsigned int _total_vertex_count,
+	float* _time_hours)
+{
+	spdlog::stopwatch sw;
+
+	spdlog::info("Start Time: {}", (*_time_hours));
+
+	lib_impl->setTime(*_time_hours);
+	lib_impl->simulateAdaptive(_output_times_hours, _output_count, _vertex_temperatures, _total_vertex_count);
+	(*_time_hours) = lib_impl->getTimeHours();
+
+	spdlog::info("End Time: {}", (*_time_hours));
+
+	spdlog::info("---> simulate_adaptive dur.: {}", sw);
+
+	return 0;
+}
+
+extern "C" int set_adaptive_tolerance(float _relative, float _absolute_kelvin)
+{
+	spdlog::info("---> adaptive tolerance: relative = {}, absolute = {} K", _relative, _absolute_kelvin);
+	lib_impl->setAdaptiveTolerance(_relative, _absolute_kelvin);
+	return 0;
+}
+
+extern "C" int set_transport_precision(int _precision)
+{
+	spdlog::info("---> transport precision: {}", _precision);
+	lib_impl->setTransportPrecision(_precision);
+	return 0;
+}
+
+extern "C" int set_mixed_precision(bool _enabled, unsigned int _refinement_steps)
+{
+	spdlog::info("---> mixed precision: {}, refinement steps: {}", _enabled, _refinement_steps);
+	lib_impl->setMixedPrecision(_enabled, _refinement_steps);
+	return 0;
+}
+
+extern "C" int set_steady_state_solver(bool _anderson, bool _warm_start)
+{
+	spdlog::info("---> steady state solver: anderson = {}, warm start = {}", _anderson, _warm_start);
+	lib_impl->setSteadyStateSolver(_anderson, _warm_start);
+	return 0;
+}
+
+extern "C" int set_preconditioner(int _type, bool _rebuild_per_step)
+{
+	spdlog::info("---> preconditioner: {}, rebuild per step: {}", _type, _rebuild_per_step);
+	if (!lib_impl->setPreconditioner(_type, _rebuild_per_step))
+		return -1;
+	return 0;
+}
+
+extern "C" int set_multigrid(unsigned int _coarse_size, unsigned int _smoother_steps)
+{
+	spdlog::info("---> multigrid: coarse size: {}, smoother steps: {}", _coarse_size, _smoother_steps);
+	lib_impl->setMultigrid(_coarse_size, _smoother_steps);
+	return 0;
+}
+
+extern "C" int set_exponential_integrator(bool _enabled, unsigned int _dense_limit)
+{
+	spdlog::info("---> exponential integrator: {}, dense limit: {}", _enabled, _dense_limit);
+	lib_impl->setExponentialIntegrator(_enabled, _dense_limit);
+	return 0;
+}
+
+extern "C" int get_solver_statistics(unsigned int* _iterations, unsigned int* _krylov_iterations, float* _seconds)
+{
+	lib_impl->getSolverStatistics(_iterations, _krylov_iterations, _seconds);
+	return 0;
+}
+
+extern "C" int set_reduced_model(bool _collect_snapshots, bool _use_reduced)
+{
+	spdlog::info("---> reduced model: collect snapshots = {}, use = {}", _collect_snapshots, _use_reduced);
+	lib_impl->setReducedModel(_collect_snapshots, _use_reduced);
+	return 0;
+}
+
+extern "C" int build_reduced_model(unsigned int _rank, unsigned int _deim_rank)
+{
+	spdlog::stopwatch sw;
+	if (!lib_impl->buildReducedModel(_rank, _deim_rank))
+		return -1;
+	spdlog::info("---> build_reduced_model() dur.: {}", sw);
+	return 0;
+}
+
 extern "C" int reset_simulation()
 {
 	lib_impl->resetSimulation();
@@ -495,6 +589,68 @@ extern "C" int set_ray_batch_count(unsigned int _ray_count, unsigned int _batch_
 	return 0;
 }
 
+extern "C" int set_target_relative_error(float _error)
+{
+	spdlog::info("---> target relative error = {}", _error);
+	lib_impl->setTargetRelativeError(_error);
+	return 0;
+}
+
+extern "C" int refine_transport(unsigned int _batch_count)
+{
+	spdlog::stopwatch sw;
+
+	lib_impl->refineTransportMatrix(_batch_count);
+	lib_impl->resetSimulation();
+	spdlog::info("---> refine_transport dur.: {}", sw);
+
+	return 0;
+}
+
+extern "C" int set_transport_cache(bool _enabled, const char* _directory)
+{
+	spdlog::info("---> transport cache = {}, directory = {}", _enabled, _directory);
+	lib_impl->setTransportCache(_enabled, _directory);
+	return 0;
+}
+
+extern "C" int set_cpu_transport(bool _enabled)
+{
+	spdlog::info("---> cpu transport = {}", _enabled);
+	lib_impl->setCpuTransport(_enabled);
+	return 0;
+}
+
+extern "C" int set_reciprocal_transport(bool _enabled)
+{
+	spdlog::info("---> reciprocal transport = {}", _enabled);
+	lib_impl->setReciprocalTransport(_enabled);
+	return 0;
+}
+
+extern "C" int get_reciprocity_report(float* _residual, float* _change, float* _error_ratio)
+{
+	const ThermalTransport::ReciprocityReport_s& report = lib_impl->getReciprocityReport();
+	*_residual = report.residual;
+	*_change = report.change;
+	*_error_ratio = report.errorRatio;
+	return 0;
+}
+
+extern "C" int set_transport_sampler(int _sampler)
+{
+	spdlog::info("---> transport sampler = {}", _sampler);
+	lib_impl->setTransportSampler(_sampler);
+	return 0;
+}
+
+extern "C" int set_ray_allocation(bool _proportional, unsigned int _min_rays)
+{
+	spdlog::info("---> ray allocation proportional = {}, min rays = {}", _proportional, _min_rays);
+	lib_impl->setRayAllocation(_proportional, _min_rays);
+	return 0;
+}
+
 extern "C" int set_minimum_sky_kelvin(float _min)
 {
 	spdlog::info("---> set_minimum_sky_kelvin = {}", _min);
@@ -508,6 +664,22 @@ extern "C" int set_steady_state(bool _enabled)
 	return 0;
 }
 
+extern "C" int simulate_sky_conditions(
+	float* _sky_values,
+	unsigned int _quad_count,
+	unsigned int _condition_count,
+	float* _vertex_temperatures,
+	unsigned int _total_vertex_count)
+{
+	spdlog::stopwatch sw;
+
+	if (!lib_impl->solveSkyConditions(_sky_values, _quad_count, _condition_count, _vertex_temperatures, _total_vertex_count))
+		return -1;
+	spdlog::info("---> simulate_sky_conditions ({} conditions) dur.: {}", _condition_count, sw);
+
+	return 0;
+}
+
 extern "C" int get_vertex_temperatures(
 	float* _vertex_temperatures,
 	unsigned int _total_vertex_count)
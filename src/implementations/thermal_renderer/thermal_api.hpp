@@ -42,6 +42,28 @@ extern "C" thermal_renderer_lib_EXPORT int reset_simulation();
 
 extern "C" thermal_renderer_lib_EXPORT int set_ray_batch_count(unsigned int _ray_count, unsigned int _batch_count);
 
+// stop tracing batches once the hit weighted mean of the relative standard errors of the free vertex rows reaches _error,
+// sum_k se_k / sum_k mean_k over the per batch hit rates, rows with less than 16 hits are left out, 0 disables
+extern "C" thermal_renderer_lib_EXPORT int set_target_relative_error(float _error);
+
+extern "C" thermal_renderer_lib_EXPORT int refine_transport(unsigned int _batch_count);
+
+extern "C" thermal_renderer_lib_EXPORT int set_transport_cache(bool _enabled, const char* _directory);
+
+// trace the transport on the cpu (bvh, all cores) instead of the vulkan ray tracing pipeline
+extern "C" thermal_renderer_lib_EXPORT int set_cpu_transport(bool _enabled);
+
+// reciprocity (A_i a_i P_ji = A_j a_j P_ij) combines the estimates of both directions, about half the rays for the same error
+extern "C" thermal_renderer_lib_EXPORT int set_reciprocal_transport(bool _enabled);
+// of the last normalization: directional reciprocity residual, relative change of the matrix, standard error ratio (reciprocal / directional)
+extern "C" thermal_renderer_lib_EXPORT int get_reciprocity_report(float* _residual, float* _change, float* _error_ratio);
+
+// 0: pseudo-random, 1: Owen-scrambled Sobol (stratified positions and directions per triangle, best with power of two ray counts)
+extern "C" thermal_renderer_lib_EXPORT int set_transport_sampler(int _sampler);
+
+// proportional: ray count x triangles rays in total, at least _min_rays per triangle and the rest by area x emissivity (area outside the kelvin mode)
+extern "C" thermal_renderer_lib_EXPORT int set_ray_allocation(bool _proportional, unsigned int _min_rays);
+
 extern "C" thermal_renderer_lib_EXPORT int set_minimum_sky_kelvin(float _min);
 
 extern "C" thermal_renderer_lib_EXPORT int set_steady_state(bool _enabled);
@@ -51,6 +73,53 @@ extern "C" thermal_renderer_lib_EXPORT int simulate(
 	unsigned int _time_step_count,
 	float* _time_hours);
 
+// transient simulation with adaptive step size from the current time, the state is reported at every output time
+// _output_times_hours: ascending, _vertex_temperatures: vertex_count x output_count, row-major
+extern "C" thermal_renderer_lib_EXPORT int simulate_adaptive(
+	float* _output_times_hours,
+	unsigned int _output_count,
+	float* _vertex_temperatures,
+	unsigned int _total_vertex_count,
+	float* _time_hours);
+
+extern "C" thermal_renderer_lib_EXPORT int set_adaptive_tolerance(float _relative, float _absolute_kelvin);
+
+// value storage of the transport matrix in the solver products: 0 = fp32, 1 = bf16, 2 = fp16 (fp32 accumulation)
+// bf16/fp16 halve the values read per product but add a packed copy next to the fp32 values: memory grows by 2 bytes per non-zero
+extern "C" thermal_renderer_lib_EXPORT int set_transport_precision(int _precision);
+
+// Newton with double residuals and iterative refinement of the float Krylov corrections
+extern "C" thermal_renderer_lib_EXPORT int set_mixed_precision(bool _enabled, unsigned int _refinement_steps);
+
+// steady state: Anderson-accelerated fixed point instead of Newton, warm start from previous solutions
+extern "C" thermal_renderer_lib_EXPORT int set_steady_state_solver(bool _anderson, bool _warm_start);
+
+// 0 = none, 1 = Jacobi, 2 = block Jacobi (per object), 3 = ILUT, 4 = multigrid; rebuilt every solve (time step) or kept until the transport matrix changes
+// returns -1 for an unknown type
+extern "C" thermal_renderer_lib_EXPORT int set_preconditioner(int _type, bool _rebuild_per_step);
+// multigrid (type 4): coarsening stops below _coarse_size variables (that level is factorized), _smoother_steps damped Jacobi pre- and post-smoothing steps per level
+extern "C" thermal_renderer_lib_EXPORT int set_multigrid(unsigned int _coarse_size, unsigned int _smoother_steps);
+
+// transient mode 1: exponential integrator instead of implicit steps, dense exponential up to _dense_limit vertices, Krylov (Arnoldi) above
+// enabling it turns the steady state off, like the gui checkbox
+extern "C" thermal_renderer_lib_EXPORT int set_exponential_integrator(bool _enabled, unsigned int _dense_limit);
+// Newton/fixed point and Krylov iterations and duration of the last solve
+extern "C" thermal_renderer_lib_EXPORT int get_solver_statistics(unsigned int* _iterations, unsigned int* _krylov_iterations, float* _seconds);
+
+// reduced order model (kelvin mode): collect snapshots from time steps, build a rank-k POD basis, then step in k dimensions
+extern "C" thermal_renderer_lib_EXPORT int set_reduced_model(bool _collect_snapshots, bool _use_reduced);
+extern "C" thermal_renderer_lib_EXPORT int build_reduced_model(unsigned int _rank, unsigned int _deim_rank);
+
+// solves one steady state per sky condition against the same transport matrix
+// _sky_values: quad_count x condition_count, _vertex_temperatures: vertex_count x condition_count, both row-major
+// returns -1 without a sky, if quad_count is 0 or exceeds the sky mesh or the vertex count does not match the scene
+extern "C" thermal_renderer_lib_EXPORT int simulate_sky_conditions(
+	float* _sky_values,
+	unsigned int _quad_count,
+	unsigned int _condition_count,
+	float* _vertex_temperatures,
+	unsigned int _total_vertex_count);
+
 extern "C" thermal_renderer_lib_EXPORT int get_vertex_temperatures(
 	float* _vertex_temperatures,
 	unsigned int _total_vertex_count);
@@ -0,0 +1,220 @@
+#include "thermal_cache.hpp"
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+#include <algorithm>
+#include <limits>
+
+#define THERMAL_CACHE_MAGIC "THTRANSP"
+#define THERMAL_CACHE_VERSION 1
+#define THERMAL_CACHE_ALIGNMENT 64
+
+static_assert(sizeof(ThermalCache::Header_s) == THERMAL_CACHE_ALIGNMENT, "cache header must fill one alignment block");
+
+static std::streamoff alignOffset(std::streamoff _offset)
+{
+	return (_offset + THERMAL_CACHE_ALIGNMENT - 1) / THERMAL_CACHE_ALIGNMENT * THERMAL_CACHE_ALIGNMENT;
+}
+
+uint64_t ThermalCache::hashBytes(uint64_t _hash, const void* _data, size_t _size)
+{
+	// FNV-1a
+	const uint8_t* bytes = (const uint8_t*)_data;
+	for (size_t i = 0; i < _size; i++)
+	{
+		_hash ^= bytes[i];
+		_hash *= 0x100000001b3ull;
+	}
+	return _hash;
+}
+
+uint64_t ThermalCache::hashScene(scene_s& _scene, const ThermalObjects& _objects)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+
+	for (RefModel_s* refModel : _scene.refModels)
+	{
+		hash = hashBytes(hash, &refModel->model_matrix[0][0], sizeof(glm::mat4));
+		for (RefMesh_s* refMesh : refModel->refMeshes)
+		{
+			Mesh* m = refMesh->mesh;
+			for (const vertex_s& v : *m->getVerticesVector())
+				hash = hashBytes(hash, &v.position, sizeof(glm::vec4));
+			const std::vector<uint32_t>& indices = *m->getIndicesVector();
+			hash = hashBytes(hash, indices.data(), indices.size() * sizeof(uint32_t));
+		}
+	}
+
+	// properties the normalized matrix depends on, temperatures are excluded on purpose
+	for (unsigned int i = 0; i < _objects.count; i++)
+	{
+		SCALAR props[6] = { _objects.diffuseReflectance[i], _objects.specularReflectance[i], _objects.absorption[i],
+			_objects.density[i], _objects.heatCapacity[i], _objects.thickness[i] };
+		bool flags[2] = { _objects.diffuseEmission[i], _objects.traceable[i] };
+		hash = hashBytes(hash, props, sizeof(props));
+		hash = hashBytes(hash, flags, sizeof(flags));
+	}
+
+	return hash;
+}
+
+uint64_t ThermalCache::hashTransport(uint64_t _scene_hash, unsigned int _batch_count, unsigned int _ray_count, unsigned int _ray_depth, int _mode, SCALAR _target_error, bool _reciprocal, unsigned int _sampler, unsigned int _min_rays)
+{
+	uint32_t settings[6] = { THERMAL_CACHE_VERSION, sizeof(SCALAR), _batch_count, _ray_count, _ray_depth, (uint32_t)_mode };
+	_scene_hash = hashBytes(_scene_hash, settings, sizeof(settings));
+	// the reciprocal estimate, other samplers and the proportional ray allocation (_min_rays > 0) are only hashed when enabled, existing files stay valid
+	if (_reciprocal)
+	{
+		uint32_t reciprocal = 1;
+		_scene_hash = hashBytes(_scene_hash, &reciprocal, sizeof(reciprocal));
+	}
+	if (_sampler)
+	{
+		uint32_t sampler = _sampler;
+		_scene_hash = hashBytes(_scene_hash, &sampler, sizeof(sampler));
+	}
+	if (_min_rays)
+	{
+		uint32_t allocation[2] = { 1, _min_rays };
+		_scene_hash = hashBytes(_scene_hash, allocation, sizeof(allocation));
+	}
+	// early stopping changes the traced batch count
+	return hashBytes(_scene_hash, &_target_error, sizeof(SCALAR));
+}
+
+std::string ThermalCache::getPath(uint64_t _hash) const
+{
+	std::stringstream ss;
+	ss << std::hex << std::setw(16) << std::setfill('0') << _hash;
+	return (std::filesystem::path(directory) / (ss.str() + ".transport")).string();
+}
+
+bool ThermalCache::load(uint64_t _hash, SpMat& _matrix, unsigned int _vertex_count) const
+{
+	if (!enabled)
+		return false;
+
+	std::string path = getPath(_hash);
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open())
+		return false;
+
+	Header_s header;
+	file.read((char*)&header, sizeof(Header_s));
+	if (!file || std::memcmp(header.magic, THERMAL_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+		header.version != THERMAL_CACHE_VERSION || header.scalarSize != sizeof(SCALAR) || header.hash != _hash)
+	{
+		spdlog::warn("ThermalCache: ignoring invalid cache file {}", path);
+		return false;
+	}
+
+	// check the dimensions and the file size before allocating anything
+	const int64_t n = std::max(1u, _vertex_count);
+	if (header.rows != n || header.cols != n || header.nonZeros < 0 || header.nonZeros > header.rows * header.cols ||
+		header.nonZeros > std::numeric_limits<SpMat::StorageIndex>::max())
+	{
+		spdlog::warn("ThermalCache: cache file {} does not match the scene ({} x {}, non-zeros: {}, expected {} x {})", path, header.rows, header.cols, header.nonZeros, n, n);
+		return false;
+	}
+	std::streamoff inner_offset = alignOffset(sizeof(Header_s) + (header.rows + 1) * sizeof(SpMat::StorageIndex));
+	std::streamoff value_offset = alignOffset(inner_offset + header.nonZeros * sizeof(SpMat::StorageIndex));
+	std::streamoff end = value_offset + header.nonZeros * sizeof(SCALAR);
+	std::error_code ec;
+	if ((std::streamoff)std::filesystem::file_size(path, ec) < end || ec)
+	{
+		spdlog::warn("ThermalCache: truncated cache file {}", path);
+		return false;
+	}
+
+	_matrix = SpMat(header.rows, header.cols);
+	_matrix.resizeNonZeros(header.nonZeros);
+
+	file.seekg(sizeof(Header_s));
+	file.read((char*)_matrix.outerIndexPtr(), (header.rows + 1) * sizeof(SpMat::StorageIndex));
+	file.seekg(inner_offset);
+	file.read((char*)_matrix.innerIndexPtr(), header.nonZeros * sizeof(SpMat::StorageIndex));
+	file.seekg(value_offset);
+	file.read((char*)_matrix.valuePtr(), header.nonZeros * sizeof(SCALAR));
+
+	// a corrupted index section would make every later product read out of bounds
+	bool valid = (bool)file && _matrix.outerIndexPtr()[0] == 0 && _matrix.outerIndexPtr()[header.rows] == header.nonZeros;
+	for (int64_t r = 0; valid && r < header.rows; r++)
+		valid = _matrix.outerIndexPtr()[r] <= _matrix.outerIndexPtr()[r + 1];
+	for (int64_t k = 0; valid && k < header.nonZeros; k++)
+		valid = _matrix.innerIndexPtr()[k] >= 0 && _matrix.innerIndexPtr()[k] < header.cols;
+	if (!valid)
+	{
+		spdlog::warn("ThermalCache: corrupted cache file {}, retracing", path);
+		_matrix = SpMat(header.rows, header.cols);
+		return false;
+	}
+
+	spdlog::info("ThermalCache: loaded transport matrix {} ({} x {}, non-zeros: {})", path, header.rows, header.cols, header.nonZeros);
+	return true;
+}
+
+bool ThermalCache::store(uint64_t _hash, const SpMat& _matrix) const
+{
+	if (!enabled)
+		return false;
+	if (!_matrix.isCompressed())
+	{
+		spdlog::error("ThermalCache: transport matrix must be compressed");
+		return false;
+	}
+
+	std::error_code ec;
+	std::filesystem::create_directories(directory, ec);
+	std::string path = getPath(_hash);
+	std::string tmp_path = path + ".tmp";
+	std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+	if (!file.is_open())
+	{
+		spdlog::warn("ThermalCache: could not write {}", tmp_path);
+		return false;
+	}
+
+	Header_s header = {};
+	std::memcpy(header.magic, THERMAL_CACHE_MAGIC, sizeof(header.magic));
+	header.version = THERMAL_CACHE_VERSION;
+	header.scalarSize = sizeof(SCALAR);
+	header.hash = _hash;
+	header.rows = _matrix.rows();
+	header.cols = _matrix.cols();
+	header.nonZeros = _matrix.nonZeros();
+
+	const char zeros[THERMAL_CACHE_ALIGNMENT] = {};
+	auto pad = [&]() {
+		std::streamoff offset = file.tellp();
+		file.write(zeros, alignOffset(offset) - offset);
+	};
+
+	file.write((const char*)&header, sizeof(Header_s));
+	file.write((const char*)_matrix.outerIndexPtr(), (header.rows + 1) * sizeof(SpMat::StorageIndex));
+	pad();
+	file.write((const char*)_matrix.innerIndexPtr(), header.nonZeros * sizeof(SpMat::StorageIndex));
+	pad();
+	file.write((const char*)_matrix.valuePtr(), header.nonZeros * sizeof(SCALAR));
+	file.close();
+
+	if (!file)
+	{
+		spdlog::warn("ThermalCache: could not write {}", tmp_path);
+		std::filesystem::remove(tmp_path, ec);
+		return false;
+	}
+
+	// replace atomically so concurrent runs never see a partial file
+	std::filesystem::rename(tmp_path, path, ec);
+	if (ec)
+	{
+		spdlog::warn("ThermalCache: could not move {} to {}", tmp_path, path);
+		return false;
+	}
+
+	spdlog::info("ThermalCache: stored transport matrix {}", path);
+	return true;
+}
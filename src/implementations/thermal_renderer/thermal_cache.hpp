@@ -0,0 +1,43 @@
+#pragma once
+
+#include <tamashii/engine/scene/render_scene.hpp>
+
+#include "thermal_common.hpp"
+#include "thermal_objects.hpp"
+
+#include <string>
+
+T_USE_NAMESPACE
+
+// on-disk cache of normalized transport matrices, keyed by a hash over everything the matrix depends on
+// file layout: header | outer indices (rows + 1) | inner indices (nnz) | values (nnz), each section 64 byte aligned
+class ThermalCache {
+
+public:
+
+	typedef struct Header_s {
+		char magic[8];
+		uint32_t version;
+		uint32_t scalarSize;
+		uint64_t hash;
+		int64_t rows;
+		int64_t cols;
+		int64_t nonZeros;
+		uint8_t padding[16];
+	} Header_s;
+
+	static uint64_t hashScene(scene_s& _scene, const ThermalObjects& _objects);
+	static uint64_t hashTransport(uint64_t _scene_hash, unsigned int _batch_count, unsigned int _ray_count, unsigned int _ray_depth, int _mode, SCALAR _target_error, bool _reciprocal = false, unsigned int _sampler = 0, unsigned int _min_rays = 0);
+
+	std::string getPath(uint64_t _hash) const;
+	// false if missing or not matching _vertex_count (dimensions, index structure), the matrix is traced again then
+	bool load(uint64_t _hash, SpMat& _matrix, unsigned int _vertex_count) const;
+	bool store(uint64_t _hash, const SpMat& _matrix) const;
+
+	bool enabled = true;
+	std::string directory = "./cache/transport";
+
+private:
+
+	static uint64_t hashBytes(uint64_t _hash, const void* _data, size_t _size);
+};
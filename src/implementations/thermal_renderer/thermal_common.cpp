@@ -28,4 +28,42 @@ void printVramSize(rvk::LogicalDevice* _device)
 	VkPhysicalDeviceMemoryBudgetPropertiesEXT props = _device->getMemoryBudgetProperties();
 	for(int i=0;i<16; i++)
 		spdlog::info("heap #{}, budget: {}, usage: {}", i, props.heapBudget[i], props.heapUsage[i]);
-}
\ No newline at end of file
+}
+
+VkDeviceSize getDeviceLocalBudget(rvk::LogicalDevice* _device)
+{
+	// largest remaining budget of a device local heap
+	VkPhysicalDeviceMemoryBudgetPropertiesEXT budget = _device->getMemoryBudgetProperties();
+	const VkPhysicalDeviceMemoryProperties& props = _device->getPhysicalDevice()->getMemoryProperties();
+	VkDeviceSize available = 0;
+	for (uint32_t i = 0; i < props.memoryHeapCount; i++)
+	{
+		if (!(props.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT))
+			continue;
+		if (budget.heapBudget[i] > budget.heapUsage[i])
+			available = std::max(available, budget.heapBudget[i] - budget.heapUsage[i]);
+	}
+	return available;
+}
+
+VkDeviceSize getHostCoherentBudget(rvk::LogicalDevice* _device, bool& _device_local)
+{
+	// largest remaining budget of a heap with host visible and coherent memory, device local on integrated gpus
+	VkPhysicalDeviceMemoryBudgetPropertiesEXT budget = _device->getMemoryBudgetProperties();
+	const VkPhysicalDeviceMemoryProperties& props = _device->getPhysicalDevice()->getMemoryProperties();
+	const VkMemoryPropertyFlags flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	VkDeviceSize available = 0;
+	_device_local = false;
+	for (uint32_t i = 0; i < props.memoryTypeCount; i++)
+	{
+		if ((props.memoryTypes[i].propertyFlags & flags) != flags)
+			continue;
+		const uint32_t heap = props.memoryTypes[i].heapIndex;
+		if (budget.heapBudget[heap] > budget.heapUsage[heap] && budget.heapBudget[heap] - budget.heapUsage[heap] > available)
+		{
+			available = budget.heapBudget[heap] - budget.heapUsage[heap];
+			_device_local = props.memoryHeaps[heap].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+		}
+	}
+	return available;
+}
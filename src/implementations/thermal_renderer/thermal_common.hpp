@@ -1,6 +1,7 @@
 #pragma once
 
 #include <Eigen/Eigen>
+#include <Eigen/Sparse>
 
 #include "spdlog/spdlog.h"
 #include "spdlog/fmt/ostr.h"
@@ -14,6 +15,11 @@ using namespace Eigen;
 typedef float SCALAR;
 typedef Matrix<SCALAR, Eigen::Dynamic, 1> Vec;
 typedef Matrix<SCALAR, Eigen::Dynamic, Eigen::Dynamic, RowMajor> Mat;
+typedef Matrix<SCALAR, Eigen::Dynamic, Eigen::Dynamic, ColMajor> ColMat; // one column per condition
+typedef SparseMatrix<SCALAR, RowMajor> SpMat;
+typedef SparseMatrix<uint64_t, RowMajor> SpHitMat; // exact ray hit counts
+typedef Matrix<uint64_t, Eigen::Dynamic, 1> HitVec;
+typedef Matrix<unsigned int, Eigen::Dynamic, 3, RowMajor> TriangleIndices;
 
 const SCALAR kelvinUnitFactor = 1e-3; // kilo kelvin
 const SCALAR secondsUnitFactor = 1.0 / 3600.0; // hours
@@ -26,6 +32,8 @@ SCALAR sky_value_to_kelvin(SCALAR _value, SCALAR _area, SCALAR _min);
 SCALAR condistion_number(Mat _mat);
 
 void printVramSize(rvk::LogicalDevice* _device);
+VkDeviceSize getDeviceLocalBudget(rvk::LogicalDevice* _device);
+VkDeviceSize getHostCoherentBudget(rvk::LogicalDevice* _device, bool& _device_local);
 
 template <typename T>
 void logEigenBase(const std::string tag, const DenseBase<T>& v)
@@ -45,6 +53,22 @@ void logEigenBase(const std::string tag, const DenseBase<T>& v)
 #endif // !RUNTIME_OPTIMIZED
 }
 
+template <typename T>
+void logEigenBase(const std::string tag, const SparseMatrixBase<T>& m)
+{
+#ifndef RUNTIME_OPTIMIZED
+	const T& s = m.derived();
+	Map<const Vec> values(s.valuePtr(), s.nonZeros());
+	spdlog::debug("{}: {} x {}, nnz: {}", tag, s.rows(), s.cols(), s.nonZeros());
+	if (s.nonZeros() > 0)
+	{
+		spdlog::debug("\tmin: {}", values.minCoeff());
+		spdlog::debug("\tmean (nnz): {}", values.mean());
+		spdlog::debug("\tmax : {}", values.maxCoeff());
+	}
+#endif // !RUNTIME_OPTIMIZED
+}
+
 typedef struct ThermalVars_s {
 	// simulation
 	bool reset = false;
@@ -55,6 +79,19 @@ typedef struct ThermalVars_s {
 	int rayDepth = 0;
 	int rayCount = 10000;
 	int batchCount = 50;
+	float targetRelativeError = 0.0f; // stop tracing batches once reached, 0 disables
+	bool refineTransport = false;
+	bool cpuTransport = false; // trace on the host instead of the ray tracing pipeline
+	bool reciprocalTransport = false; // combine both directions of every vertex pair
+	int transportSampler = 0; // TRANSPORT_SAMPLER_*
+	bool proportionalRays = false; // distribute rayCount x triangles by area x emissivity
+	int minTriangleRays = 16;
+	// reduced order model
+	bool collectSnapshots = false;
+	bool useReducedModel = false;
+	bool buildReducedModel = false;
+	int reducedRank = 20;
+	int reducedDeimRank = 40;
 } ThermalVars_s;
 
 typedef struct ObjectStatistics_s {
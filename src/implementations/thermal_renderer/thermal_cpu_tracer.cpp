@@ -0,0 +1,497 @@
+#include "thermal_cpu_tracer.hpp"
+
+#include <omp.h>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#define CPU_TRACER_MAX_DEPTH 32
+#define CPU_TRACER_STACK_SIZE 64
+#define CPU_TRACER_T_MAX 10000.0f
+
+void ThermalCpuTracer::build(const ThermalData& _thermalData, const ThermalObjects& _objects)
+{
+	clear();
+
+	materials.resize(_objects.count);
+	for (unsigned int i = 0; i < _objects.count; i++)
+	{
+		materials[i].diffuseReflectance = _objects.diffuseReflectance[i];
+		materials[i].specularReflectance = _objects.specularReflectance[i];
+		materials[i].diffuseEmission = _objects.diffuseEmission[i];
+		materials[i].traceable = _objects.traceable[i];
+	}
+
+	const TriangleIndices& indices = _thermalData.triangleVertexIndices;
+	const Mat& positions = _thermalData.vertexPositions;
+	triangles.resize(indices.rows());
+	for (Index k = 0; k < indices.rows(); k++)
+	{
+		glm::vec3 p[3];
+		for (int c = 0; c < 3; c++)
+			p[c] = glm::vec3(positions(indices(k, c), 0), positions(indices(k, c), 1), positions(indices(k, c), 2));
+
+		// vertex ranges of the objects are ascending, the instance is the last object starting at or before the first vertex
+		auto it = std::upper_bound(_objects.vertexOffset.begin(), _objects.vertexOffset.end(), indices(k, 0));
+		Triangle_s& t = triangles[k];
+		t.p0 = p[0];
+		t.edge1 = p[1] - p[0];
+		t.edge2 = p[2] - p[0];
+		t.normal = glm::normalize(glm::cross(p[1] - p[0], p[2] - p[1]));
+		t.instance = (unsigned int)std::max<std::ptrdiff_t>(0, (it - _objects.vertexOffset.begin()) - 1);
+	}
+
+	buildBVH();
+	built = true;
+
+	spdlog::info("ThermalCpuTracer: built BVH with {} nodes (depth {}) over {} of {} triangles", nodes.size(), treeDepth, bvhTriangles.size(), triangles.size());
+}
+
+void ThermalCpuTracer::clear()
+{
+	built = false;
+	triangles.clear();
+	materials.clear();
+	bvhTriangles.clear();
+	nodes.clear();
+	treeDepth = 0;
+}
+
+void ThermalCpuTracer::buildBVH()
+{
+	// only traceable instances are hit (instance mask 0xff vs. 0x0f against the ray mask 0xf0)
+	bvhTriangles.clear();
+	for (unsigned int k = 0; k < triangles.size(); k++)
+		if (triangles[k].instance < materials.size() && materials[triangles[k].instance].traceable)
+			bvhTriangles.push_back(k);
+
+	nodes.clear();
+	if (bvhTriangles.empty())
+		return;
+
+	std::vector<glm::vec3> minBounds(triangles.size());
+	std::vector<glm::vec3> maxBounds(triangles.size());
+	std::vector<glm::vec3> centroids(triangles.size());
+	for (unsigned int k : bvhTriangles)
+	{
+		const Triangle_s& t = triangles[k];
+		minBounds[k] = glm::min(t.p0, glm::min(t.p0 + t.edge1, t.p0 + t.edge2));
+		maxBounds[k] = glm::max(t.p0, glm::max(t.p0 + t.edge1, t.p0 + t.edge2));
+		centroids[k] = (minBounds[k] + maxBounds[k]) * 0.5f;
+	}
+
+	auto area = [](const glm::vec3& _min, const glm::vec3& _max) {
+		glm::vec3 d = glm::max(_max - _min, glm::vec3(0.0f));
+		return d.x * d.y + d.y * d.z + d.z * d.x;
+	};
+
+	const unsigned int bins = glm::max(bin_count, 2u);
+	std::vector<unsigned int> binCount(bins);
+	std::vector<glm::vec3> binMin(bins), binMax(bins);
+	std::vector<float> rightCost(bins);
+
+	nodes.reserve(2 * bvhTriangles.size());
+	nodes.push_back({ glm::vec3(0.0f), 0, glm::vec3(0.0f), (unsigned int)bvhTriangles.size() });
+	std::vector<std::pair<unsigned int, unsigned int>> stack = { { 0, 1 } }; // node, depth
+	treeDepth = 0;
+	while (!stack.empty())
+	{
+		const unsigned int node_index = stack.back().first;
+		const unsigned int depth = stack.back().second;
+		stack.pop_back();
+		treeDepth = glm::max(treeDepth, depth);
+
+		Node_s node = nodes[node_index];
+		glm::vec3 node_min(std::numeric_limits<float>::max()), node_max(-std::numeric_limits<float>::max());
+		glm::vec3 centroid_min(std::numeric_limits<float>::max()), centroid_max(-std::numeric_limits<float>::max());
+		for (unsigned int i = node.first; i < node.first + node.count; i++)
+		{
+			const unsigned int k = bvhTriangles[i];
+			node_min = glm::min(node_min, minBounds[k]);
+			node_max = glm::max(node_max, maxBounds[k]);
+			centroid_min = glm::min(centroid_min, centroids[k]);
+			centroid_max = glm::max(centroid_max, centroids[k]);
+		}
+		nodes[node_index].minAABB = node_min;
+		nodes[node_index].maxAABB = node_max;
+		if (node.count <= max_leaf_size)
+			continue;
+
+		// binned SAH, the split with the lowest area weighted triangle count over all axes
+		float best_cost = std::numeric_limits<float>::max();
+		int best_axis = -1;
+		unsigned int best_bin = 0;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			const float extent = centroid_max[axis] - centroid_min[axis];
+			if (extent <= 0.0f)
+				continue;
+			const float scale = bins / extent;
+
+			std::fill(binCount.begin(), binCount.end(), 0);
+			std::fill(binMin.begin(), binMin.end(), glm::vec3(std::numeric_limits<float>::max()));
+			std::fill(binMax.begin(), binMax.end(), glm::vec3(-std::numeric_limits<float>::max()));
+			for (unsigned int i = node.first; i < node.first + node.count; i++)
+			{
+				const unsigned int k = bvhTriangles[i];
+				const unsigned int b = glm::min(bins - 1, (unsigned int)((centroids[k][axis] - centroid_min[axis]) * scale));
+				binCount[b]++;
+				binMin[b] = glm::min(binMin[b], minBounds[k]);
+				binMax[b] = glm::max(binMax[b], maxBounds[k]);
+			}
+
+			// sweep from the right, then evaluate every split from the left
+			glm::vec3 right_min(std::numeric_limits<float>::max()), right_max(-std::numeric_limits<float>::max());
+			unsigned int right_count = 0;
+			for (unsigned int b = bins - 1; b > 0; b--)
+			{
+				right_min = glm::min(right_min, binMin[b]);
+				right_max = glm::max(right_max, binMax[b]);
+				right_count += binCount[b];
+				rightCost[b] = right_count ? right_count * area(right_min, right_max) : 0.0f;
+			}
+			glm::vec3 left_min(std::numeric_limits<float>::max()), left_max(-std::numeric_limits<float>::max());
+			unsigned int left_count = 0;
+			for (unsigned int b = 0; b + 1 < bins; b++)
+			{
+				left_min = glm::min(left_min, binMin[b]);
+				left_max = glm::max(left_max, binMax[b]);
+				left_count += binCount[b];
+				if (left_count == 0 || left_count == node.count)
+					continue;
+				const float cost = left_count * area(left_min, left_max) + rightCost[b + 1];
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					best_axis = axis;
+					best_bin = b;
+				}
+			}
+		}
+
+		// all centroids coincide, keep the leaf
+		if (best_axis < 0)
+			continue;
+
+		const float scale = bins / (centroid_max[best_axis] - centroid_min[best_axis]);
+		auto middle = std::partition(bvhTriangles.begin() + node.first, bvhTriangles.begin() + node.first + node.count, [&](unsigned int k) {
+			return glm::min(bins - 1, (unsigned int)((centroids[k][best_axis] - centroid_min[best_axis]) * scale)) <= best_bin;
+		});
+		const unsigned int left_count = (unsigned int)(middle - (bvhTriangles.begin() + node.first));
+
+		const unsigned int left = nodes.size();
+		nodes.push_back({ glm::vec3(0.0f), node.first, glm::vec3(0.0f), left_count });
+		nodes.push_back({ glm::vec3(0.0f), node.first + left_count, glm::vec3(0.0f), node.count - left_count });
+		nodes[node_index].first = left;
+		nodes[node_index].count = 0;
+		stack.push_back({ left + 1, depth + 1 });
+		stack.push_back({ left, depth + 1 });
+	}
+}
+
+bool ThermalCpuTracer::intersect(const glm::vec3& _origin, const glm::vec3& _direction, float _t_max, unsigned int& _triangle) const
+{
+	if (nodes.empty())
+		return false;
+
+	const glm::vec3 inv_dir = 1.0f / _direction;
+	float closest = _t_max;
+	bool hit = false;
+
+	// slab test, returns the entry distance or infinity on a miss
+	auto enter = [&](const Node_s& _node) {
+		const glm::vec3 t0 = (_node.minAABB - _origin) * inv_dir;
+		const glm::vec3 t1 = (_node.maxAABB - _origin) * inv_dir;
+		const glm::vec3 t_near = glm::min(t0, t1);
+		const glm::vec3 t_far = glm::max(t0, t1);
+		const float t_enter = glm::max(glm::max(t_near.x, t_near.y), glm::max(t_near.z, 0.0f));
+		const float t_exit = glm::min(glm::min(t_far.x, t_far.y), glm::min(t_far.z, closest));
+		return t_enter <= t_exit ? t_enter : std::numeric_limits<float>::infinity();
+	};
+
+	// every inner node on the path leaves at most one sibling behind, degenerate trees deeper than the local stack use the heap
+	unsigned int local_stack[CPU_TRACER_STACK_SIZE];
+	std::vector<unsigned int> heap_stack;
+	unsigned int* stack = local_stack;
+	if (treeDepth + 1 > CPU_TRACER_STACK_SIZE)
+	{
+		heap_stack.resize(treeDepth + 1);
+		stack = heap_stack.data();
+	}
+	unsigned int stack_size = 0;
+	if (enter(nodes[0]) == std::numeric_limits<float>::infinity())
+		return false;
+	stack[stack_size++] = 0;
+	while (stack_size > 0)
+	{
+		const Node_s& node = nodes[stack[--stack_size]];
+		if (node.count > 0)
+		{
+			// Moeller-Trumbore, both faces are hit like in the ray tracing pipeline, the backface check follows on the hit
+			for (unsigned int i = node.first; i < node.first + node.count; i++)
+			{
+				const Triangle_s& t = triangles[bvhTriangles[i]];
+				const glm::vec3 p = glm::cross(_direction, t.edge2);
+				const float det = glm::dot(t.edge1, p);
+				if (det == 0.0f)
+					continue;
+				const float inv_det = 1.0f / det;
+				const glm::vec3 s = _origin - t.p0;
+				const float u = glm::dot(s, p) * inv_det;
+				if (u < 0.0f || u > 1.0f)
+					continue;
+				const glm::vec3 q = glm::cross(s, t.edge1);
+				const float v = glm::dot(_direction, q) * inv_det;
+				if (v < 0.0f || u + v > 1.0f)
+					continue;
+				const float dist = glm::dot(t.edge2, q) * inv_det;
+				if (dist > 0.0f && dist < closest)
+				{
+					closest = dist;
+					_triangle = bvhTriangles[i];
+					hit = true;
+				}
+			}
+			continue;
+		}
+
+		// visit the nearer child first, the farther one is skipped once a closer hit is known
+		float t_left = enter(nodes[node.first]);
+		float t_right = enter(nodes[node.first + 1]);
+		unsigned int near_child = node.first, far_child = node.first + 1;
+		if (t_right < t_left)
+		{
+			std::swap(t_left, t_right);
+			std::swap(near_child, far_child);
+		}
+		if (t_right != std::numeric_limits<float>::infinity())
+			stack[stack_size++] = far_child;
+		if (t_left != std::numeric_limits<float>::infinity())
+			stack[stack_size++] = near_child;
+	}
+	return hit;
+}
+
+// random numbers, seeding and sampling follow the shader utils so both paths consume the sequence in the same order
+uint32_t ThermalCpuTracer::initRandomSeed(uint32_t _val0, uint32_t _val1)
+{
+	uint32_t v0 = _val0, v1 = _val1, s0 = 0;
+	for (uint32_t n = 0; n < 16; n++)
+	{
+		s0 += 0x9e3779b9;
+		v0 += ((v1 << 4) + 0xa341316c) ^ (v1 + s0) ^ ((v1 >> 5) + 0xc8013ea4);
+		v1 += ((v0 << 4) + 0xad90777d) ^ (v0 + s0) ^ ((v0 >> 5) + 0x7e95761e);
+	}
+	return v0;
+}
+
+float ThermalCpuTracer::randomFloat(uint32_t& _seed)
+{
+	_seed = 1664525u * _seed + 1013904223u;
+	const uint32_t bits = 0x3f800000 | (0x007fffff & (_seed >> 9));
+	float f;
+	std::memcpy(&f, &bits, sizeof(float));
+	return f - 1.0f;
+}
+
+// Owen-scrambled 2D Sobol as in sobol.glsl (Burley, Practical Hash-based Owen Scrambling)
+static uint32_t reverseBits(uint32_t _x)
+{
+	_x = ((_x >> 1) & 0x55555555u) | ((_x & 0x55555555u) << 1);
+	_x = ((_x >> 2) & 0x33333333u) | ((_x & 0x33333333u) << 2);
+	_x = ((_x >> 4) & 0x0f0f0f0fu) | ((_x & 0x0f0f0f0fu) << 4);
+	_x = ((_x >> 8) & 0x00ff00ffu) | ((_x & 0x00ff00ffu) << 8);
+	return (_x >> 16) | (_x << 16);
+}
+
+static uint32_t nestedUniformScramble(uint32_t _x, uint32_t _seed)
+{
+	_x = reverseBits(_x);
+	_x += _seed;
+	_x ^= _x * 0x6c50b47cu;
+	_x ^= _x * 0xb82f1e52u;
+	_x ^= _x * 0xc7afe638u;
+	_x ^= _x * 0x8d22f6e6u;
+	return reverseBits(_x);
+}
+
+static uint32_t hashCombine(uint32_t _seed, uint32_t _v)
+{
+	return _seed ^ (_v + 0x9e3779b9u + (_seed << 6) + (_seed >> 2));
+}
+
+glm::vec2 ThermalCpuTracer::sobolOwen2D(uint32_t _index, uint32_t _seed)
+{
+	// shuffled per seed, the padded blocks must not share their index
+	_index = nestedUniformScramble(_index, _seed);
+	uint32_t x = reverseBits(_index), y = 0;
+	for (uint32_t v = 1u << 31; _index != 0; _index >>= 1, v ^= v >> 1)
+		if (_index & 1u)
+			y ^= v;
+	x = nestedUniformScramble(x, hashCombine(_seed, 0));
+	y = nestedUniformScramble(y, hashCombine(_seed, 1));
+	return glm::vec2(float(x >> 8), float(y >> 8)) * (1.0f / 16777216.0f);
+}
+
+glm::vec2 ThermalCpuTracer::sample2D(Sampler_s& _sampler, uint32_t _block)
+{
+	if (_sampler.type == TRANSPORT_SAMPLER_SOBOL)
+		return sobolOwen2D(_sampler.index, hashCombine(_sampler.scramble, _block));
+	// rand(seed).xy, the third number is drawn but unused like in the shader
+	const float u = randomFloat(_sampler.seed);
+	const float v = randomFloat(_sampler.seed);
+	randomFloat(_sampler.seed);
+	return glm::vec2(u, v);
+}
+
+glm::vec3 ThermalCpuTracer::offsetRay(const glm::vec3& _p, const glm::vec3& _n)
+{
+	const float origin = 1.0f / 32.0f;
+	const float float_scale = 1.0f / 65536.0f;
+	const float int_scale = 256.0f;
+
+	glm::vec3 result;
+	for (int c = 0; c < 3; c++)
+	{
+		const int32_t of_i = (int32_t)(int_scale * _n[c]);
+		int32_t bits;
+		std::memcpy(&bits, &_p[c], sizeof(float));
+		bits += (_p[c] < 0) ? -of_i : of_i;
+		float p_i;
+		std::memcpy(&p_i, &bits, sizeof(float));
+		result[c] = std::abs(_p[c]) < origin ? _p[c] + float_scale * _n[c] : p_i;
+	}
+	return result;
+}
+
+glm::vec3 ThermalCpuTracer::tangentSpaceToWorldSpace(const glm::vec3& _v, const glm::vec3& _n)
+{
+	// getPerpendicularVector
+	const glm::vec3 a = glm::abs(_n);
+	const unsigned int xm = ((a.x - a.y) < 0 && (a.x - a.z) < 0) ? 1 : 0;
+	const unsigned int ym = (a.y - a.z) < 0 ? (1 ^ xm) : 0;
+	const unsigned int zm = 1 ^ (xm | ym);
+	const glm::vec3 t = glm::normalize(glm::cross(_n, glm::vec3(xm, ym, zm)));
+	const glm::vec3 b = glm::normalize(glm::cross(_n, t));
+	return glm::mat3(t, b, _n) * _v;
+}
+
+glm::vec3 ThermalCpuTracer::samplePoint(const Triangle_s& _triangle, const glm::vec2& _uv) const
+{
+	const float sqrt_u = std::sqrt(_uv.x);
+	return _triangle.p0 + (sqrt_u * (1.0f - _uv.y)) * _triangle.edge1 + (sqrt_u * _uv.y) * _triangle.edge2;
+}
+
+ThermalCpuTracer::Ray_s ThermalCpuTracer::getEmissionRay(unsigned int _triangle, Sampler_s& _sampler) const
+{
+	const Triangle_s& t = triangles[_triangle];
+	Ray_s ray;
+	ray.origin = offsetRay(samplePoint(t, sample2D(_sampler, 0)), t.normal);
+	ray.direction = t.normal;
+	ray.absorbed = false;
+
+	if (materials[t.instance].diffuseEmission) {
+		// cosine weighted hemisphere (Malley)
+		const glm::vec2 uv = sample2D(_sampler, 1);
+		const float r = std::sqrt(uv.x);
+		const float theta = 2.0f * glm::pi<float>() * uv.y;
+		const glm::vec2 disk = r * glm::vec2(std::cos(theta), std::sin(theta));
+		const glm::vec3 direction = glm::vec3(disk, std::sqrt(glm::max(0.0f, 1.0f - disk.x * disk.x - disk.y * disk.y)));
+		ray.direction = tangentSpaceToWorldSpace(direction, t.normal);
+	}
+	return ray;
+}
+
+ThermalCpuTracer::Ray_s ThermalCpuTracer::getNextRay(unsigned int _triangle, const glm::vec3& _inDir, Sampler_s& _sampler, uint32_t _block) const
+{
+	const Triangle_s& t = triangles[_triangle];
+	const Material_s& material = materials[t.instance];
+	Ray_s ray;
+	ray.origin = offsetRay(samplePoint(t, sample2D(_sampler, _block)), t.normal);
+	ray.direction = t.normal;
+	ray.absorbed = false;
+
+	const float rnd = sample2D(_sampler, _block + 1).x;
+
+	if (rnd >= material.diffuseReflectance + material.specularReflectance) {	// absorb
+		ray.absorbed = true;
+	}
+	else if (rnd >= material.diffuseReflectance) {								// specular reflection
+		ray.direction = glm::reflect(glm::normalize(_inDir), t.normal);
+	}
+	else {																		// diffuse reflection
+		glm::vec2 uv;
+		if (_sampler.type == TRANSPORT_SAMPLER_SOBOL)
+			uv = sobolOwen2D(_sampler.index, hashCombine(_sampler.scramble, _block + 2));
+		else {
+			uv.x = randomFloat(_sampler.seed);
+			uv.y = randomFloat(_sampler.seed);
+		}
+		const float z = uv.x;
+		const float theta = 2.0f * glm::pi<float>() * uv.y;
+		const float r = std::sqrt(glm::max(0.0f, 1.0f - z * z));
+		ray.direction = tangentSpaceToWorldSpace(glm::vec3(r * std::cos(theta), r * std::sin(theta), z), t.normal);
+	}
+	return ray;
+}
+
+void ThermalCpuTracer::traceTriangles(unsigned int _offset, unsigned int _count, const std::vector<TriangleRaysSSBO>& _rays, unsigned int _ray_depth, unsigned int _batch_seed, std::vector<TransportRecord>& _records, unsigned int _sampler) const
+{
+	const int last = (int)glm::min((size_t)_offset + _count, glm::min(triangles.size(), _rays.size()));
+	const unsigned int task_size = glm::max(triangles_per_task, 1u);
+
+	// per thread records, merged once all triangles are traced
+	std::vector<std::vector<TransportRecord>> threadRecords(omp_get_max_threads());
+
+#pragma omp parallel for schedule(dynamic, task_size)
+	for (int triangle_id = (int)_offset; triangle_id < last; triangle_id++)
+	{
+		std::vector<TransportRecord>& records = threadRecords[omp_get_thread_num()];
+		Sampler_s sampler;
+		sampler.type = _sampler;
+		sampler.seed = initRandomSeed(triangle_id, _batch_seed);
+		// sobol: fixed scrambling per triangle, batches continue the sequence from the triangle's sample offset
+		sampler.scramble = initRandomSeed(triangle_id, 0x5bd1e995u);
+
+		for (unsigned int n = 0; n < _rays[triangle_id].rayCount; n++)
+		{
+			unsigned int depth = 0;
+
+			sampler.seed += n;
+			sampler.index = _rays[triangle_id].sampleOffset + n;
+			Ray_s ray = getEmissionRay(triangle_id, sampler);
+
+			// emission (diagonal) is known per ray and added on the host
+			while (true)
+			{
+				depth += 1;
+
+				if ((_ray_depth > 0 && depth > _ray_depth) || depth > CPU_TRACER_MAX_DEPTH)
+					break;
+
+				unsigned int hit_triangle;
+				if (!intersect(ray.origin, ray.direction, CPU_TRACER_T_MAX, hit_triangle))
+					break;
+
+				if (glm::dot(triangles[hit_triangle].normal, ray.direction) > 0)
+					break;
+
+				sampler.seed += n + depth;
+				ray = getNextRay(hit_triangle, ray.direction, sampler, 3 * depth - 1);
+
+				if (ray.absorbed) {
+					records.push_back({ (uint32_t)triangle_id, hit_triangle });
+					break;
+				}
+			}
+		}
+	}
+
+	size_t total = _records.size();
+	for (const std::vector<TransportRecord>& records : threadRecords)
+		total += records.size();
+	_records.reserve(total);
+	for (const std::vector<TransportRecord>& records : threadRecords)
+		_records.insert(_records.end(), records.begin(), records.end());
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include "../../../assets/shader/raytracing_thermal/defines.h"
+
+#include "thermal_common.hpp"
+#include "thermal_data.hpp"
+#include "thermal_objects.hpp"
+
+#include <vector>
+
+// cpu version of the light tracing in transport_ray.rgen (emission, diffuse/specular/absorb decisions, 0xf0 masking of
+// non traceable objects) over a binned SAH BVH, produces the same (emitter triangle, absorber triangle) records
+class ThermalCpuTracer {
+
+public:
+
+	void build(const ThermalData& _thermalData, const ThermalObjects& _objects);
+	// traces the allocated rays of each triangle in [_offset, _offset + _count), the records of all threads are appended to _records
+	void traceTriangles(unsigned int _offset, unsigned int _count, const std::vector<TriangleRaysSSBO>& _rays, unsigned int _ray_depth, unsigned int _batch_seed, std::vector<TransportRecord>& _records,
+		unsigned int _sampler = TRANSPORT_SAMPLER_RANDOM) const;
+	void clear();
+
+	bool isBuilt() const { return built; }
+	unsigned int getTriangleCount() const { return triangles.size(); }
+	unsigned int getNodeCount() const { return nodes.size(); }
+	unsigned int getTreeDepth() const { return treeDepth; }
+
+	unsigned int max_leaf_size = 4;
+	unsigned int bin_count = 16;
+	unsigned int triangles_per_task = 16; // granularity of the dynamic schedule, idle threads take the next task
+
+private:
+
+	typedef struct Triangle_s {
+		glm::vec3 p0;
+		glm::vec3 edge1;	// p1 - p0
+		glm::vec3 edge2;	// p2 - p0
+		glm::vec3 normal;
+		unsigned int instance;
+	} Triangle_s;
+
+	typedef struct Material_s {
+		float diffuseReflectance;
+		float specularReflectance;
+		bool diffuseEmission;
+		bool traceable;
+	} Material_s;
+
+	// leaves reference count triangles starting at first in bvhTriangles, inner nodes have count 0 and their children at first and first + 1
+	typedef struct Node_s {
+		glm::vec3 minAABB;
+		unsigned int first;
+		glm::vec3 maxAABB;
+		unsigned int count;
+	} Node_s;
+
+	typedef struct Sampler_s {
+		unsigned int type;	// TRANSPORT_SAMPLER_*
+		uint32_t seed;		// random state
+		uint32_t index;		// sobol sample index of the ray
+		uint32_t scramble;	// sobol scrambling of the triangle
+	} Sampler_s;
+
+	typedef struct Ray_s {
+		glm::vec3 origin;
+		glm::vec3 direction;
+		bool absorbed;
+	} Ray_s;
+
+	void buildBVH();
+	// closest traceable triangle along the ray, false on a miss
+	bool intersect(const glm::vec3& _origin, const glm::vec3& _direction, float _t_max, unsigned int& _triangle) const;
+
+	Ray_s getEmissionRay(unsigned int _triangle, Sampler_s& _sampler) const;
+	Ray_s getNextRay(unsigned int _triangle, const glm::vec3& _inDir, Sampler_s& _sampler, uint32_t _block) const;
+	glm::vec3 samplePoint(const Triangle_s& _triangle, const glm::vec2& _uv) const;
+
+	static uint32_t initRandomSeed(uint32_t _val0, uint32_t _val1);
+	static float randomFloat(uint32_t& _seed);
+	static glm::vec2 sample2D(Sampler_s& _sampler, uint32_t _block);
+	static glm::vec2 sobolOwen2D(uint32_t _index, uint32_t _seed);
+	static glm::vec3 offsetRay(const glm::vec3& _p, const glm::vec3& _n);
+	static glm::vec3 tangentSpaceToWorldSpace(const glm::vec3& _v, const glm::vec3& _n);
+
+	bool built = false;
+	std::vector<Triangle_s> triangles;		// global triangle order, the same as ThermalData::triangleVertexIndices
+	std::vector<Material_s> materials;		// per instance
+	std::vector<unsigned int> bvhTriangles;	// traceable triangles in leaf order
+	std::vector<Node_s> nodes;
+	unsigned int treeDepth = 0;	// levels including the root, bounds the traversal stack
+};
@@ -13,6 +13,8 @@ void ThermalData::init(scene_s _scene, const ThermalObjects& _thermal_object, un
 
 	vertexAreaVector = Vec(_vertex_count);
 	vertexAreaVector.setConstant(0.0);
+	vertexPositions = Mat(_vertex_count, 3);
+	vertexPositions.setConstant(0.0);
 
 	vertexTriangleCountVector = VectorXi(_vertex_count);
 	vertexTriangleCountVector.setConstant(0);
@@ -20,6 +22,9 @@ void ThermalData::init(scene_s _scene, const ThermalObjects& _thermal_object, un
 	triangleAreaVector = Vec(_triangle_count);
 	triangleAreaVector.setConstant(0.0);
 
+	triangleVertexIndices = TriangleIndices(_triangle_count, 3);
+	triangleVertexIndices.setConstant(0);
+
 	fixedVarsVector = Vec(_vertex_count);
 	fixedVarsVector.setConstant(0.0);
 }
@@ -41,6 +46,12 @@ void ThermalData::load(scene_s _scene, ThermalObjects& _thermal_objects, SCALAR
 			for (auto i : *m->getIndicesVector())
 				vertexTriangleCountVector(vertex_offset + i) += 1;
 
+			for (unsigned int vi = 0; vi < m->getVertexCount(); vi++)
+			{
+				glm::vec4 p = refModel->model_matrix * m->getVerticesVector()->at(vi).position;
+				vertexPositions.row(vertex_offset + vi) << p.x / p.w, p.y / p.w, p.z / p.w;
+			}
+
 			for (int vi = 0; vi < m->getIndexCount(); vi += 3)
 			{
 				unsigned int ind0 = m->getIndicesVector()->at(vi);
@@ -65,6 +76,7 @@ void ThermalData::load(scene_s _scene, ThermalObjects& _thermal_objects, SCALAR
 				vertexAreaVector[vertex_offset + ind0] += area / 3.0;
 				vertexAreaVector[vertex_offset + ind1] += area / 3.0;
 				vertexAreaVector[vertex_offset + ind2] += area / 3.0;
+				triangleVertexIndices.row(triangle_index_offset) << vertex_offset + ind0, vertex_offset + ind1, vertex_offset + ind2;
 				triangleAreaVector[triangle_index_offset++] = area;
 			}
 			fixedVarsVector.segment(vertex_offset, m->getVertexCount()).setConstant(_thermal_objects.temperatureFixed[i]);
@@ -163,6 +175,7 @@ void ThermalData::unload()
 	vertexAreaVector.resize(0);
 	vertexTriangleCountVector.resize(0);
 	triangleAreaVector.resize(0);
+	triangleVertexIndices.resize(0, 3);
 	fixedVarsVector.resize(0);
 	objectStatistics.clear();
 }
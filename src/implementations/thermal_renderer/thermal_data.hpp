@@ -24,8 +24,10 @@ public:
 	Vec	absorptionVector;
 
 	Vec vertexAreaVector;
+	Mat vertexPositions; // world space, vertex count x 3
 	VectorXi vertexTriangleCountVector;
 	Vec triangleAreaVector;
+	TriangleIndices triangleVertexIndices; // global vertex indices per triangle
 	Vec fixedVarsVector;
 
 	std::vector<ObjectStatistics_s> objectStatistics;
@@ -61,6 +61,9 @@ void ThermalGui::draw(
 			{
 				if (ImGui::InputFloat("Solver Step", &solver.step_size, 1.0, 0.01, "%.3f"))
 					solver.step_size = std::max<SCALAR>(0.0, solver.step_size);
+				ImGui::Checkbox("Warm Start", &solver.warm_start);
+				ImGui::SameLine();
+				ImGui::Checkbox("Anderson Acceleration", &solver.anderson_acceleration);
 			}
 			else
 			{
@@ -69,6 +72,40 @@ void ThermalGui::draw(
 				if (ImGui::InputInt("Time Step Count", &thermalVars.timeSteps, 1, 10))
 					thermalVars.timeSteps = std::max<int>(1, thermalVars.timeSteps);
 			}
+			int preconditioner = solver.preconditioner;
+			if (ImGui::Combo("Preconditioner", &preconditioner, "None\0Jacobi\0Block Jacobi\0ILUT\0Multigrid\0"))
+				solver.preconditioner = (ThermalPreconditioner::Type)preconditioner;
+			ImGui::Checkbox("Rebuild Per Step", &solver.rebuild_preconditioner);
+			ImGui::Text("Iterations: %d | Krylov Iterations: %d | %.3f s", solver.solve_iterations, solver.krylov_iterations, solver.solve_seconds);
+			ImGui::Checkbox("Mixed Precision Newton", &solver.mixed_precision);
+			int precision = (int)solver.getTransportPrecision();
+			if (ImGui::Combo("Transport Storage", &precision, "FP32\0BF16\0FP16\0"))
+				solver.setTransportPrecision((TransportPrecision)precision);
+			if (ImGui::IsItemHovered())
+				ImGui::SetTooltip("BF16/FP16 halve the values read per product,\nthe packed copy adds 2 bytes per non-zero to the FP32 matrix");
+			if (precision != (int)TransportPrecision::FP32)
+				ImGui::Text("Storage Rel. Error: %.2e", solver.getTransportStorageError());
+			ImGui::Checkbox("Collect Snapshots", &thermalVars.collectSnapshots);
+			if (ImGui::InputInt("Reduced Rank", &thermalVars.reducedRank, 1, 10))
+				thermalVars.reducedRank = std::max<int>(1, thermalVars.reducedRank);
+			if (ImGui::InputInt("DEIM Rank", &thermalVars.reducedDeimRank, 1, 10))
+				thermalVars.reducedDeimRank = std::max<int>(1, thermalVars.reducedDeimRank);
+			if (ImGui::Button("Build Reduced Model"))
+				thermalVars.buildReducedModel = true;
+			ImGui::SameLine();
+			ImGui::Checkbox("Use Reduced Model", &thermalVars.useReducedModel);
+		}
+		else if (solver.mode == 1)
+		{
+			if (ImGui::Checkbox("Exponential Integrator", &solver.exponential_integrator))
+				solver.compute_steady_state = !solver.exponential_integrator;
+			if (solver.exponential_integrator)
+			{
+				if (ImGui::InputFloat("Time Step", &solver.step_size, 1.0, 0.01, "%.3f"))
+					solver.step_size = std::max<SCALAR>(0.0, solver.step_size);
+				if (ImGui::InputInt("Time Step Count", &thermalVars.timeSteps, 1, 10))
+					thermalVars.timeSteps = std::max<int>(1, thermalVars.timeSteps);
+			}
 		}
 		if (ImGui::Button("Run"))
 		{
@@ -94,9 +131,23 @@ void ThermalGui::draw(
 		if (ImGui::InputInt("Batch Count", &thermalVars.batchCount, 1, 1)) {
 			thermalVars.rayCount = std::clamp<int>(thermalVars.rayCount, 1, thermalVars.rayCount);
 		}
+		ImGui::InputFloat("Target Rel. Error", &thermalVars.targetRelativeError, 0.001f, 0.01f, "%.4f");
+		thermalVars.targetRelativeError = std::max(thermalVars.targetRelativeError, 0.0f);
+		ImGui::Checkbox("CPU Tracing", &thermalVars.cpuTransport);
+		ImGui::SameLine();
+		ImGui::Checkbox("Reciprocal", &thermalVars.reciprocalTransport);
+		ImGui::Combo("Sampler", &thermalVars.transportSampler, "Random\0Sobol\0");
+		ImGui::Checkbox("Area Weighted Rays", &thermalVars.proportionalRays);
+		if (thermalVars.proportionalRays && ImGui::InputInt("Min. Rays", &thermalVars.minTriangleRays, 1, 16)) {
+			thermalVars.minTriangleRays = std::max(thermalVars.minTriangleRays, 1);
+		}
 		if (ImGui::Button("Recompute Transport")) {
 			thermalVars.recomputeTransport = true;
 		}
+		ImGui::SameLine();
+		if (ImGui::Button("Refine Transport")) {
+			thermalVars.refineTransport = true;
+		}
 		ImGui::Separator();
 		ImGui::Text("Misc:");
 		ImGui::SliderFloat("Clip Distance", &clipDistance, 0.0, 100.0);
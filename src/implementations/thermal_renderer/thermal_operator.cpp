@@ -0,0 +1,202 @@
+#include "thermal_operator.hpp"
+
+#include <omp.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#define TRANSPORT_OPERATOR_COLUMN_BLOCK 8
+
+void TransportOperator::setMatrix(const SpMat* _matrix, TransportPrecision _precision)
+{
+	matrix = _matrix;
+	precision = _precision;
+	updateChunks();
+	packValues();
+}
+
+void TransportOperator::setPrecision(TransportPrecision _precision)
+{
+	precision = _precision;
+	packValues();
+}
+
+void TransportOperator::updateChunks()
+{
+	chunks.clear();
+	if (!matrix || !matrix->isCompressed())
+		return;
+
+	// a few chunks per thread, balanced by non-zeros since row lengths vary with the geometry
+	const Index rows = matrix->rows();
+	const Index nnz = matrix->nonZeros();
+	const int chunk_count = std::max<int>(1, std::min<Index>(rows, 4 * omp_get_max_threads()));
+	const SpMat::StorageIndex* outer = matrix->outerIndexPtr();
+	chunks.push_back(0);
+	for (int c = 1; c < chunk_count; c++)
+	{
+		const Index target = (nnz * c) / chunk_count;
+		const Index row = std::upper_bound(outer, outer + rows + 1, target) - outer - 1;
+		if (row > chunks.back())
+			chunks.push_back(row);
+	}
+	chunks.push_back(rows);
+}
+
+void TransportOperator::packValues()
+{
+	bf16Values.clear();
+	fp16Values.clear();
+	valueScale = 1.0;
+	storageError = 0.0;
+	activePrecision = TransportPrecision::FP32;
+	if (!matrix || chunks.empty() || precision == TransportPrecision::FP32 || matrix->nonZeros() == 0)
+		return;
+
+	const Index nnz = matrix->nonZeros();
+	const SCALAR* values = matrix->valuePtr();
+	if (precision == TransportPrecision::BF16)
+	{
+		bf16Values.resize(nnz);
+		for (Index k = 0; k < nnz; k++)
+			bf16Values[k] = Eigen::bfloat16(values[k]);
+	}
+	else
+	{
+		const SCALAR max_abs = Map<const Vec>(values, nnz).cwiseAbs().maxCoeff();
+		if (max_abs > 0.0)
+			valueScale = std::ldexp(SCALAR(1.0), 14 - std::ilogb(max_abs));
+		fp16Values.resize(nnz);
+		for (Index k = 0; k < nnz; k++)
+			fp16Values[k] = Eigen::half(values[k] * valueScale);
+	}
+	activePrecision = precision;
+
+	// check against fp32 with a positive vector, the kelvin solver only multiplies with x^4 >= 0
+	// (golden ratio ramp in [0.5, 1.5), deterministic so the fallback does not depend on the rand() state)
+	Vec x(matrix->cols());
+	for (Index k = 0; k < x.size(); k++)
+		x[k] = SCALAR(0.5 + std::fmod(double(k) * 0.6180339887498949, 1.0));
+	Vec reference = (*matrix) * x;
+	Vec packed;
+	apply(x, packed);
+	const SCALAR scale = std::max<SCALAR>(reference.cwiseAbs().maxCoeff(), std::numeric_limits<SCALAR>::min());
+	storageError = (packed - reference).cwiseAbs().maxCoeff() / scale;
+
+	const char* name = precision == TransportPrecision::BF16 ? "bf16" : "fp16";
+	if (storageError > max_storage_error)
+	{
+		spdlog::warn("TransportOperator - {} storage error {} exceeds {}, using fp32", name, storageError, max_storage_error);
+		bf16Values.clear();
+		fp16Values.clear();
+		valueScale = 1.0;
+		activePrecision = TransportPrecision::FP32;
+		return;
+	}
+	spdlog::info("TransportOperator - {} storage: {} values ({:.3} MB), rel. error to fp32: {}", name, nnz, double(nnz * 2) / (1024.0 * 1024.0), storageError);
+}
+
+// S: precision of the vectors and the accumulation, V: storage of the matrix values
+template <typename V, typename S>
+static void multiplyRows(const SpMat& _matrix, const std::vector<Index>& _chunks, const V* _values, SCALAR _inv_scale, const Matrix<S, Eigen::Dynamic, 1>& _x, Matrix<S, Eigen::Dynamic, 1>& _out, bool _parallel)
+{
+	const SpMat::StorageIndex* outer = _matrix.outerIndexPtr();
+	const SpMat::StorageIndex* inner = _matrix.innerIndexPtr();
+	const S* x = _x.data();
+	S* out = _out.data();
+	const int chunk_count = _chunks.size() - 1;
+
+#pragma omp parallel for schedule(dynamic, 1) if(_parallel)
+	for (int c = 0; c < chunk_count; c++)
+	{
+		for (Index r = _chunks[c]; r < _chunks[c + 1]; r++)
+		{
+			S sum = 0.0;
+			for (SpMat::StorageIndex k = outer[r]; k < outer[r + 1]; k++)
+				sum += static_cast<S>(static_cast<SCALAR>(_values[k])) * x[inner[k]];
+			out[r] = sum * _inv_scale;
+		}
+	}
+}
+
+template <typename V>
+static void multiplyRows(const SpMat& _matrix, const std::vector<Index>& _chunks, const V* _values, SCALAR _inv_scale, const Mat& _X, ColMat& _out, bool _parallel)
+{
+	const int n = _X.cols();
+	const SpMat::StorageIndex* outer = _matrix.outerIndexPtr();
+	const SpMat::StorageIndex* inner = _matrix.innerIndexPtr();
+	const int chunk_count = _chunks.size() - 1;
+
+#pragma omp parallel for schedule(dynamic, 1) if(_parallel)
+	for (int c = 0; c < chunk_count; c++)
+	{
+		SCALAR acc[TRANSPORT_OPERATOR_COLUMN_BLOCK];
+		for (Index r = _chunks[c]; r < _chunks[c + 1]; r++)
+		{
+			for (int b = 0; b < n; b += TRANSPORT_OPERATOR_COLUMN_BLOCK)
+			{
+				const int width = std::min(TRANSPORT_OPERATOR_COLUMN_BLOCK, n - b);
+				std::fill(acc, acc + TRANSPORT_OPERATOR_COLUMN_BLOCK, SCALAR(0.0));
+				for (SpMat::StorageIndex k = outer[r]; k < outer[r + 1]; k++)
+				{
+					const SCALAR v = static_cast<SCALAR>(_values[k]);
+					const SCALAR* row = _X.data() + (Index)inner[k] * n + b;
+					for (int j = 0; j < width; j++)
+						acc[j] += v * row[j];
+				}
+				for (int j = 0; j < width; j++)
+					_out(r, b + j) = acc[j] * _inv_scale;
+			}
+		}
+	}
+}
+
+template <typename S>
+void TransportOperator::applyVector(const Matrix<S, Eigen::Dynamic, 1>& _x, Matrix<S, Eigen::Dynamic, 1>& _out, bool _parallel) const
+{
+	if (chunks.empty())
+	{
+		_out = matrix->template cast<S>() * _x;
+		return;
+	}
+
+	_out.resize(matrix->rows());
+	const bool parallel = _parallel && matrix->nonZeros() >= (Index)min_parallel_nonzeros;
+	if (activePrecision == TransportPrecision::BF16)
+		multiplyRows(*matrix, chunks, bf16Values.data(), 1.0f / valueScale, _x, _out, parallel);
+	else if (activePrecision == TransportPrecision::FP16)
+		multiplyRows(*matrix, chunks, fp16Values.data(), 1.0f / valueScale, _x, _out, parallel);
+	else
+		multiplyRows(*matrix, chunks, matrix->valuePtr(), 1.0f, _x, _out, parallel);
+}
+
+void TransportOperator::apply(const Vec& _x, Vec& _out, bool _parallel) const
+{
+	applyVector(_x, _out, _parallel);
+}
+
+void TransportOperator::apply(const VectorXd& _x, VectorXd& _out, bool _parallel) const
+{
+	applyVector(_x, _out, _parallel);
+}
+
+void TransportOperator::apply(const ColMat& _X, ColMat& _out, bool _parallel) const
+{
+	if (chunks.empty())
+	{
+		_out = (*matrix) * _X;
+		return;
+	}
+
+	// row-major copy, so the columns gathered per non-zero are contiguous
+	const Mat X = _X;
+	_out.resize(matrix->rows(), _X.cols());
+	const bool parallel = _parallel && (Index)matrix->nonZeros() * _X.cols() >= (Index)min_parallel_nonzeros;
+	if (activePrecision == TransportPrecision::BF16)
+		multiplyRows(*matrix, chunks, bf16Values.data(), 1.0f / valueScale, X, _out, parallel);
+	else if (activePrecision == TransportPrecision::FP16)
+		multiplyRows(*matrix, chunks, fp16Values.data(), 1.0f / valueScale, X, _out, parallel);
+	else
+		multiplyRows(*matrix, chunks, matrix->valuePtr(), 1.0f, X, _out, parallel);
+}
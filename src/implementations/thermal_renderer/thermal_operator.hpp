@@ -0,0 +1,53 @@
+#pragma once
+
+#include "thermal_common.hpp"
+
+#include <vector>
+
+// storage of the matrix values used by the products, accumulation is always fp32
+enum class TransportPrecision { FP32 = 0, BF16 = 1, FP16 = 2 };
+
+// multithreaded products with a row-major sparse transport matrix (CSR), rows are split into chunks of equal non-zero count
+// results only differ from Eigen's products by rounding, every row is summed by a single thread
+// with reduced precision the values are packed into 16 bit (halves the value stream), indices are shared with the matrix
+// the packed copy comes on top of the fp32 values (+2 bytes per non-zero), those stay for the Jacobian, the preconditioners and the fp32 fallback
+class TransportOperator {
+
+public:
+
+	void setMatrix(const SpMat* _matrix, TransportPrecision _precision = TransportPrecision::FP32);
+	void setPrecision(TransportPrecision _precision);
+	TransportPrecision getPrecision() const { return activePrecision; }
+	SCALAR getStorageError() const { return storageError; }
+	const SpMat* getMatrix() const { return matrix; }
+
+	Index rows() const { return matrix ? matrix->rows() : 0; }
+	Index cols() const { return matrix ? matrix->cols() : 0; }
+
+	// out = T * x
+	void apply(const Vec& _x, Vec& _out, bool _parallel = true) const;
+	// out = T * x, accumulated in double (mixed precision residuals)
+	void apply(const VectorXd& _x, VectorXd& _out, bool _parallel = true) const;
+	// out = T * X, the columns are processed in blocks so every loaded row of T is reused for all of them
+	void apply(const ColMat& _X, ColMat& _out, bool _parallel = true) const;
+
+	unsigned int min_parallel_nonzeros = 1 << 16; // below, the thread overhead dominates
+	SCALAR max_storage_error = 1e-2; // relative, compared to fp32 products, fall back to fp32 above
+
+private:
+
+	void updateChunks();
+	void packValues();
+	template <typename S>
+	void applyVector(const Matrix<S, Eigen::Dynamic, 1>& _x, Matrix<S, Eigen::Dynamic, 1>& _out, bool _parallel) const;
+
+	const SpMat* matrix = nullptr;
+	std::vector<Index> chunks; // first row per chunk, rows() at the end
+
+	TransportPrecision precision = TransportPrecision::FP32;		// requested
+	TransportPrecision activePrecision = TransportPrecision::FP32;	// after the check against fp32
+	std::vector<Eigen::bfloat16> bf16Values;
+	std::vector<Eigen::half> fp16Values;
+	SCALAR valueScale = 1.0;	// fp16 values are stored scaled by a power of two to stay out of the subnormal range
+	SCALAR storageError = 0.0;
+};
@@ -0,0 +1,161 @@
+#include "thermal_reduced.hpp"
+
+#include <spdlog/stopwatch.h>
+
+#include <algorithm>
+
+void ThermalReducedModel::addSnapshot(const Vec& _x)
+{
+	snapshots.push_back(_x);
+}
+
+void ThermalReducedModel::clearSnapshots()
+{
+	snapshots.clear();
+}
+
+void ThermalReducedModel::clear()
+{
+	built = false;
+	basis.resize(0, 0);
+	sampledBasis.resize(0, 0);
+	reducedOperator.resize(0, 0);
+	reducedCoupling.resize(0, 0);
+}
+
+bool ThermalReducedModel::build(ThermalSolver& _solver, const SpMat& _transportMatrix, const Vec& _fixedVars, unsigned int _rank, unsigned int _deim_rank)
+{
+	clear();
+	if (snapshots.empty())
+	{
+		spdlog::error("ThermalReducedModel - no snapshots");
+		return false;
+	}
+
+	spdlog::stopwatch sw;
+	_solver.preparePartition(_transportMatrix, _fixedVars);
+	freeIndices = _solver.getFreeIndices();
+	fixedIndices = _solver.getFixedIndices();
+	const int free_count = freeIndices.size();
+
+	MatrixXd states(free_count, snapshots.size());
+	for (int s = 0; s < (int)snapshots.size(); s++)
+		for (int k = 0; k < free_count; k++)
+			states(k, s) = snapshots[s][freeIndices[k]];
+
+	// POD basis of the states and of the nonlinear term
+	BDCSVD<MatrixXd> state_svd(states, ComputeThinU);
+	BDCSVD<MatrixXd> term_svd(states.array().pow(4.0).matrix(), ComputeThinU);
+	const int rank = std::min<int>({ (int)_rank, (int)state_svd.rank(), free_count });
+	const int deim_rank = std::min<int>({ (int)_deim_rank, (int)term_svd.rank(), free_count });
+	if (rank == 0 || deim_rank == 0)
+	{
+		spdlog::error("ThermalReducedModel - snapshots have rank zero");
+		return false;
+	}
+	basis = state_svd.matrixU().leftCols(rank);
+	MatrixXd term_basis = term_svd.matrixU().leftCols(deim_rank);
+
+	// greedy DEIM interpolation indices
+	std::vector<int> samples;
+	Index first;
+	term_basis.col(0).cwiseAbs().maxCoeff(&first);
+	samples.push_back(first);
+	for (int j = 1; j < deim_rank; j++)
+	{
+		MatrixXd pu(j, j);
+		VectorXd pv(j);
+		for (int i = 0; i < j; i++)
+		{
+			pu.row(i) = term_basis.row(samples[i]).leftCols(j);
+			pv[i] = term_basis(samples[i], j);
+		}
+		VectorXd c = pu.partialPivLu().solve(pv);
+		VectorXd r = term_basis.col(j) - term_basis.leftCols(j) * c;
+		Index next;
+		r.cwiseAbs().maxCoeff(&next);
+		samples.push_back(next);
+	}
+
+	MatrixXd pu(deim_rank, deim_rank);
+	sampledBasis.resize(deim_rank, rank);
+	for (int i = 0; i < deim_rank; i++)
+	{
+		pu.row(i) = term_basis.row(samples[i]);
+		sampledBasis.row(i) = basis.row(samples[i]);
+	}
+
+	const SpMat& free_matrix = _solver.getFreeMatrix();
+	MatrixXd projected = (free_matrix.cast<double>().transpose() * basis).transpose(); // Phi^T T_ff
+	// (Phi^T T_ff U) (P^T U)^-1 as a solve with the transposed system, P^T U is often ill-conditioned
+	const MatrixXd lifted = projected * term_basis;
+	reducedOperator = pu.transpose().partialPivLu().solve(lifted.transpose()).transpose();
+	reducedCoupling = (_solver.getCouplingMatrix().cast<double>().transpose() * basis).transpose();
+	built = true;
+
+	spdlog::info("ThermalReducedModel - built from {} snapshots: {} free variables -> rank {}, deim rank {} (dur. {:.3} s)",
+		snapshots.size(), free_count, rank, deim_rank, sw);
+	return true;
+}
+
+void ThermalReducedModel::solve(ThermalSolver& _solver, Vec& _x, const Vec& _currentKelvin)
+{
+	const int free_count = freeIndices.size();
+	const double step = _solver.step_size;
+	const bool steady_state = _solver.compute_steady_state;
+
+	VectorXd fixed(fixedIndices.size());
+	for (int k = 0; k < (int)fixedIndices.size(); k++)
+		fixed[k] = _currentKelvin[fixedIndices[k]];
+	const VectorXd fixed_rhs = reducedCoupling * fixed.array().pow(4.0).matrix();
+
+	VectorXd x(free_count);
+	VectorXd current(free_count);
+	for (int k = 0; k < free_count; k++)
+	{
+		x[k] = _x[freeIndices[k]];
+		current[k] = _currentKelvin[freeIndices[k]];
+	}
+	VectorXd y = basis.transpose() * x;
+	const VectorXd current_y = basis.transpose() * current;
+
+	auto residual = [&](const VectorXd& _y) {
+		VectorXd r = step * (reducedOperator * (sampledBasis * _y).array().pow(4.0).matrix() + fixed_rhs);
+		if (!steady_state)
+			r += current_y - _y;
+		return r;
+	};
+
+	VectorXd res = residual(y);
+	int i = 0;
+	for (; i < (int)max_iter; i++)
+	{
+		VectorXd sampled = sampledBasis * y;
+		MatrixXd jac = step * reducedOperator * (4.0 * sampled.array().pow(3.0)).matrix().asDiagonal() * sampledBasis;
+		if (!steady_state)
+			jac -= MatrixXd::Identity(y.size(), y.size());
+		VectorXd dy = -jac.partialPivLu().solve(res);
+
+		// line search
+		double alpha = 1.0;
+		double res_norm = res.squaredNorm();
+		VectorXd res_alpha = residual(y + alpha * dy);
+		for (int ls = 0; ls < 32 && res_alpha.squaredNorm() > res_norm; ls++)
+		{
+			alpha *= 0.5;
+			res_alpha = residual(y + alpha * dy);
+		}
+		y += alpha * dy;
+		res = res_alpha;
+
+		if ((alpha * dy).squaredNorm() < f_tol)
+			break;
+	}
+	spdlog::info("ThermalReducedModel - iter: {}, res_norm: {}", i, res.squaredNorm());
+
+	x = basis * y;
+	for (int k = 0; k < free_count; k++)
+		_x[freeIndices[k]] = x[k];
+	for (int k : fixedIndices)
+		_x[k] = _currentKelvin[k];
+}
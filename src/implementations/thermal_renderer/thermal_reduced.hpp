@@ -0,0 +1,40 @@
+#pragma once
+
+#include "thermal_common.hpp"
+#include "thermal_solver.hpp"
+
+#include <Eigen/Dense>
+
+using namespace Eigen;
+
+// reduced order model of the kelvin (mode 0) system: free variables x = Phi * y with a POD basis Phi from state snapshots,
+// the x^4 term is approximated by DEIM (interpolation at a few selected vertices)
+class ThermalReducedModel {
+
+public:
+
+	void addSnapshot(const Vec& _x);
+	void clearSnapshots();
+	bool build(ThermalSolver& _solver, const SpMat& _transportMatrix, const Vec& _fixedVars, unsigned int _rank, unsigned int _deim_rank);
+	void solve(ThermalSolver& _solver, Vec& _x, const Vec& _currentKelvin);
+	void clear();
+
+	bool isBuilt() const { return built; }
+	unsigned int getSnapshotCount() const { return snapshots.size(); }
+	unsigned int getRank() const { return basis.cols(); }
+
+	SCALAR f_tol = 1e-10;
+	unsigned int max_iter = 100;
+
+private:
+
+	std::vector<Vec> snapshots; // full state vectors
+
+	bool built = false;
+	std::vector<int> freeIndices;
+	std::vector<int> fixedIndices;
+	MatrixXd basis;				// Phi, free variables x rank
+	MatrixXd sampledBasis;		// P^T Phi, deim rank x rank
+	MatrixXd reducedOperator;	// Phi^T T_ff U (P^T U)^-1, rank x deim rank
+	MatrixXd reducedCoupling;	// Phi^T T_f,fixed, rank x fixed variables
+};
@@ -63,9 +63,10 @@ void ThermalRenderer::prepare(renderInfo_s* aRenderInfo) {
 
 	printVramSize(mDevice);
 
-	prepareData(aRenderInfo);
+	// without the ray tracing extensions the transport is traced on the host, vulkan still holds the scene geometry and the displayed buffers
+	mThermalTransport.rtAvailable = mDevice->isExtensionActive(VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME) && mDevice->isExtensionActive(VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME);
 
-	mThermalTransport.prepare(mVkData->geometryDataBuffer, this->blas_gpu);
+	prepareData(aRenderInfo);
 
 	createSunAndSky = false;
 	sunDirections.push_back(Vector3f(1, 1, 1));
@@ -77,7 +78,10 @@ void ThermalRenderer::prepareData(renderInfo_s* aRenderInfo)
 
 	mVkData.emplace(mDevice);
 
-	blas_gpu.prepare(VK_INDEX_DATA_SIZE, VK_VERTEX_DATA_SIZE);
+	if (mThermalTransport.rtAvailable)
+		blas_gpu.prepare(VK_INDEX_DATA_SIZE, VK_VERTEX_DATA_SIZE);
+	else
+		blas_gpu.prepare(VK_INDEX_DATA_SIZE, VK_VERTEX_DATA_SIZE, rvk::Buffer::Use::STORAGE, rvk::Buffer::Use::STORAGE);
 
 	// geometry
 	mVkData->geometryDataBuffer.create(rvk::Buffer::Use::STORAGE, VK_GEOMETRY_SIZE * sizeof(GeometrySSBO), rvk::Buffer::Location::HOST_COHERENT);
@@ -235,7 +239,9 @@ void ThermalRenderer::_sceneLoad() {
 	ThermalScene::SceneProperties_s& sceneProp = mThermalScene.getProperties();
 
 	mThermalData.init(scene, termObj, sceneProp.vertexCount, sceneProp.triangleCount);
+	solver.setBlocks(termObj.vertexOffset, termObj.vertexCount);
 	mThermalData.load(scene, termObj, sky_min_kelvin);
+	solver.setGeometry(mThermalData.vertexPositions, mThermalData.vertexAreaVector);
 
 	SingleTimeCommand stc = mGetStcBuffer();
 	mThermalTransport.load(stc, mDevice, blas_gpu, mVkData->geometryDataBuffer, scene, mThermalScene, mThermalData, mThermalVars.batchCount, mThermalVars.rayCount, mThermalVars.rayDepth, solver.mode, true);
@@ -271,7 +277,11 @@ void ThermalRenderer::loadData(scene_s scene)
 	int vertex_count = 0;
 	int triangle_count = 0;
 
-	blas_gpu.loadScene(&stc, scene);
+	// the blas are only built for the ray tracing pipelines
+	if (mThermalTransport.rtAvailable)
+		blas_gpu.loadScene(&stc, scene);
+	else
+		blas_gpu.GeometryDataVulkan::loadScene(&stc, scene);
 	// no need to build any tlas if there are no models in the current scene
 	spdlog::debug("model count = {}", scene.refModels.size());
 	if (scene.refModels.size() != 0) {
@@ -291,6 +301,7 @@ void ThermalRenderer::loadData(scene_s scene)
 				if (refMesh->mesh->getMaterial()->hasBaseColorTexture()) geometry[geometry_count].baseColorTexIdx = refMesh->mesh->getMaterial()->getBaseColorTexture()->index;
 				geometry[geometry_count].alphaCutoff = refMesh->mesh->getMaterial()->getAlphaDiscardValue();
 				geometry[geometry_count].triangleCount = m->getVertexCount() / 3;
+				geometry[geometry_count].triangleOffset = triangle_count;
 
 				// index
 				if (m->hasIndices()) {
@@ -334,17 +345,88 @@ void ThermalRenderer::loadData(scene_s scene)
 	}
 }
 
+void ThermalRenderer::applyTransportSettings()
+{
+	mThermalTransport.cpuTracing = mThermalVars.cpuTransport;
+	mThermalTransport.reciprocalTransport = mThermalVars.reciprocalTransport;
+	mThermalTransport.sampler = mThermalVars.transportSampler;
+	mThermalTransport.proportionalRays = mThermalVars.proportionalRays;
+	mThermalTransport.minTriangleRays = glm::max(mThermalVars.minTriangleRays, 1);
+
+	// the pipeline, record buffers and tlas are created on the first gpu traced estimate
+	if (mThermalTransport.useRayTracing() && !mThermalTransport.isRayTracingLoaded())
+	{
+		SingleTimeCommand stc = mGetStcBuffer();
+		scene_s scene = Common::getInstance().getRenderSystem()->getMainScene()->getSceneData();
+		mThermalTransport.loadRayTracing(stc, mDevice, blas_gpu, mVkData->geometryDataBuffer, scene, mThermalScene, mThermalData);
+	}
+}
+
 void ThermalRenderer::computeTransportMatrix()
 {
 	if (!mDisableCompute)
 	{
 		SingleTimeCommand stc = mGetStcBuffer();
-		mThermalTransport.compute(stc, mDevice, mThermalScene, mThermalData, mThermalVars.batchCount, mThermalVars.rayCount, mThermalVars.rayDepth, solver.mode);
+		scene_s scene = Common::getInstance().getRenderSystem()->getMainScene()->getSceneData();
+		const uint64_t hash = ThermalCache::hashTransport(ThermalCache::hashScene(scene, mThermalScene.getObjects()),
+			mThermalVars.batchCount, mThermalVars.rayCount, mThermalVars.rayDepth, solver.mode, mThermalVars.targetRelativeError, mThermalVars.reciprocalTransport, mThermalVars.transportSampler,
+			mThermalVars.proportionalRays ? glm::max(mThermalVars.minTriangleRays, 1) : 0);
+
+		SpMat cached;
+		if (mThermalCache.load(hash, cached, mThermalScene.getProperties().vertexCount))
+		{
+			mThermalTransport.setTransportMatrix(stc, std::move(cached));
+		}
+		else
+		{
+			applyTransportSettings();
+			mThermalTransport.compute(stc, mDevice, mThermalScene, mThermalData, mThermalVars.batchCount, mThermalVars.rayCount, mThermalVars.rayDepth, solver.mode, mThermalVars.targetRelativeError);
+			mThermalCache.store(hash, mThermalTransport.getTransportMatrix());
+		}
+		// partition the new matrix on the next solve
+		solver.reset();
+		mReducedModel.clear();
+		mReducedModel.clearSnapshots();
 		mThermalGui.autoAdjustDisplayRange(mThermalData.currentValueVector);		
 	}
 	mDisableCompute = false;
 }
 
+void ThermalRenderer::refineTransportMatrix(unsigned int _batch_count)
+{
+	SingleTimeCommand stc = mGetStcBuffer();
+	applyTransportSettings();
+	// nothing accumulated (e.g. loaded from cache), start a new estimate without the cache, it would only load the same matrix again
+	if (mThermalTransport.getTracedBatches() == 0)
+		mThermalTransport.compute(stc, mDevice, mThermalScene, mThermalData, _batch_count, mThermalVars.rayCount, mThermalVars.rayDepth, solver.mode, mThermalVars.targetRelativeError);
+	else
+		mThermalTransport.refine(stc, mDevice, mThermalScene, mThermalData, _batch_count, mThermalVars.rayCount, mThermalVars.rayDepth, solver.mode, mThermalVars.targetRelativeError);
+	solver.reset();
+	mReducedModel.clear();
+}
+
+bool ThermalRenderer::setPreconditioner(int _type, bool _rebuild_per_step)
+{
+	if (_type < ThermalPreconditioner::NONE || _type > ThermalPreconditioner::MULTIGRID)
+	{
+		spdlog::error("setPreconditioner: unknown preconditioner type {}", _type);
+		return false;
+	}
+	solver.preconditioner = (ThermalPreconditioner::Type)_type;
+	solver.rebuild_preconditioner = _rebuild_per_step;
+	return true;
+}
+
+bool ThermalRenderer::buildReducedModel(unsigned int _rank, unsigned int _deim_rank)
+{
+	if (solver.mode != 0)
+	{
+		spdlog::error("buildReducedModel: only available in kelvin mode");
+		return false;
+	}
+	return mReducedModel.build(solver, mThermalTransport.getTransportMatrix(), mThermalData.fixedVarsVector, _rank, _deim_rank);
+}
+
 void ThermalRenderer::thermalInit(scene_s scene)
 {			
 	resetSimulation();
@@ -378,6 +460,55 @@ void ThermalRenderer::getValue(float* _arr, unsigned int _count, unsigned int _t
 	}
 }
 
+bool ThermalRenderer::skyValuesToKelvin(RefModel_s* _sky, const float* _arr, unsigned int _quad_count, unsigned int _stride, Vec& _values, SCALAR& _avg_sky_value)
+{
+	Vec& vertexAreaVector = mThermalData.vertexAreaVector;
+	if (_quad_count == 0)
+	{
+		spdlog::error("skyValuesToKelvin: no sky quads");
+		return false;
+	}
+	// two triangles per quad, the sky mesh has to provide the indices for all quads
+	for (RefMesh_s* refMesh : _sky->refMeshes) {
+		const std::vector<uint32_t>& vis = *refMesh->mesh->getIndicesVector();
+		if (6 * (size_t)_quad_count > vis.size())
+		{
+			spdlog::error("skyValuesToKelvin: {} sky quads exceed the sky mesh ({} quads)", _quad_count, vis.size() / 6);
+			return false;
+		}
+		for (size_t i = 0; i < 6 * (size_t)_quad_count; i++)
+		{
+			if (sky_vertex_offset + vis[i] >= _values.size())
+			{
+				spdlog::error("skyValuesToKelvin: sky vertex {} outside the value vector ({})", sky_vertex_offset + vis[i], _values.size());
+				return false;
+			}
+		}
+	}
+
+	_avg_sky_value = 0.0;
+	for (RefMesh_s* refMesh : _sky->refMeshes) {
+		Mesh* m = refMesh->mesh;
+		const std::vector<uint32_t>& vis = *m->getIndicesVector();
+		unsigned int index_offset = 0;
+		for (unsigned int i = 0; i < _quad_count; i++)
+		{
+			float sky_value = _arr[i * _stride]; // sky value in kWh/m2(/h)
+			_avg_sky_value += sky_value;
+
+			// two triangles per quad
+			for (int v = 0; v < 6; v++)
+			{
+				unsigned int vertex_ind = sky_vertex_offset + vis[index_offset++];
+				_values(vertex_ind) = sky_value_to_kelvin(sky_value, vertexAreaVector[vertex_ind], sky_min_kelvin);
+			}
+		}
+
+		_avg_sky_value /= ((float)_quad_count);
+	}
+	return true;
+}
+
 void ThermalRenderer::setKelvin(float* _arr, unsigned int _arr_size, unsigned int _vertex_offset, bool _sky_values)
 {
 	Vec& currentValueVector = mThermalData.currentValueVector;
@@ -387,46 +518,13 @@ void ThermalRenderer::setKelvin(float* _arr, unsigned int _arr_size, unsigned in
 		RenderScene* _scene = Common::getInstance().getRenderSystem()->getMainScene();
 		scene_s scene = _scene->getSceneData();
 
-		Vec& vertexAreaVector = mThermalData.vertexAreaVector;
 		SCALAR avg_sky_value = 0.0;
 		for (RefModel_s* refModel : scene.refModels) {
 
 			if (refModel->model->getName() == "Sky")
 			{
-				for (RefMesh_s* refMesh : refModel->refMeshes) {
-					Mesh* m = refMesh->mesh;
-					std::vector<uint32_t> vis = *m->getIndicesVector();
-					unsigned int index_offset = 0;
-					for (int i = 0; i < _arr_size; i++)
-					{
-						float sky_value = _arr[i]; // sky value in kWh/m2(/h)
-						avg_sky_value += sky_value;
-
-						{
-							unsigned int vertex_ind_0 = sky_vertex_offset + vis[index_offset++];
-							mThermalData.initialValueVector(vertex_ind_0) = sky_value_to_kelvin(sky_value, vertexAreaVector[vertex_ind_0], sky_min_kelvin);
-
-							unsigned int vertex_ind_1 = sky_vertex_offset + vis[index_offset++];
-							mThermalData.initialValueVector(vertex_ind_1) = sky_value_to_kelvin(sky_value, vertexAreaVector[vertex_ind_1], sky_min_kelvin);
-
-							unsigned int vertex_ind_2 = sky_vertex_offset + vis[index_offset++];
-							mThermalData.initialValueVector(vertex_ind_2) = sky_value_to_kelvin(sky_value, vertexAreaVector[vertex_ind_2], sky_min_kelvin);
-						}
-
-						{
-							unsigned int vertex_ind_0 = sky_vertex_offset + vis[index_offset++];
-							mThermalData.initialValueVector(vertex_ind_0) = sky_value_to_kelvin(sky_value, vertexAreaVector[vertex_ind_0], sky_min_kelvin);
-
-							unsigned int vertex_ind_1 = sky_vertex_offset + vis[index_offset++];
-							mThermalData.initialValueVector(vertex_ind_1) = sky_value_to_kelvin(sky_value, vertexAreaVector[vertex_ind_1], sky_min_kelvin);
-
-							unsigned int vertex_ind_2 = sky_vertex_offset + vis[index_offset++];
-							mThermalData.initialValueVector(vertex_ind_2) = sky_value_to_kelvin(sky_value, vertexAreaVector[vertex_ind_2], sky_min_kelvin);
-						}
-					}
-
-					avg_sky_value /= ((float)_arr_size);
-				}
+				if (!skyValuesToKelvin(refModel, _arr, _arr_size, 1, mThermalData.initialValueVector, avg_sky_value))
+					return;
 
 				mThermalScene.getObjects().kelvin[0] = avg_sky_value;
 
@@ -448,6 +546,55 @@ void ThermalRenderer::setKelvin(float* _arr, unsigned int _arr_size, unsigned in
 	}
 }
 
+bool ThermalRenderer::solveSkyConditions(const float* _sky_values, unsigned int _quad_count, unsigned int _condition_count, float* _vertex_temperatures, unsigned int _vertex_count)
+{
+	// _sky_values: quads x conditions, _vertex_temperatures: vertices x conditions, both row-major
+	RenderScene* _scene = Common::getInstance().getRenderSystem()->getMainScene();
+	scene_s scene = _scene->getSceneData();
+	RefModel_s* sky = nullptr;
+	for (RefModel_s* refModel : scene.refModels)
+		if (refModel->model->getName() == "Sky")
+			sky = refModel;
+	if (!sky)
+	{
+		spdlog::error("solveSkyConditions: scene has no sky");
+		return false;
+	}
+
+	const unsigned int n = mThermalData.initialValueVector.size();
+	if (_vertex_count != n)
+	{
+		spdlog::error("solveSkyConditions: vertex count {} does not match the scene ({})", _vertex_count, n);
+		return false;
+	}
+
+	ColMat current(n, _condition_count);
+	for (unsigned int c = 0; c < _condition_count; c++)
+	{
+		Vec values = mThermalData.initialValueVector;
+		SCALAR avg_sky_value;
+		if (!skyValuesToKelvin(sky, _sky_values + c, _quad_count, _condition_count, values, avg_sky_value))
+			return false;
+		current.col(c) = values;
+	}
+
+	ColMat X = current;
+	if ((solver.mode == 0) && solver.compute_steady_state)
+	{
+		for (unsigned int k = 0; k < n; k++)
+			if (mThermalData.fixedVarsVector[k] < 1.0)
+				X.row(k) = (X.row(k).array() == 0.0).select(1.0, X.row(k));
+	}
+
+	spdlog::stopwatch sw;
+	solver.solveBatch(X, current, mThermalTransport.getTransportMatrix(), mThermalData.fixedVarsVector);
+	spdlog::info("solveSkyConditions() - {} conditions | dur. {:.3} s", _condition_count, sw);
+
+	Map<Matrix<float, Eigen::Dynamic, Eigen::Dynamic, RowMajor>> out(_vertex_temperatures, n, _condition_count);
+	out = (X / kelvinUnitFactor).cast<float>();
+	return true;
+}
+
 void ThermalRenderer::setTimeStep(float _hours)
 {
 	solver.step_size = _hours * 3600.0 * secondsUnitFactor;
@@ -508,7 +655,13 @@ void ThermalRenderer::thermalTimestep()
 	spdlog::debug("value(x) = {}", val);
 #endif // !RUNTIME_OPTIMIZED
 
-	solver.solve(x, mThermalData.currentValueVector, mThermalTransport.getTransportMatrix(), mThermalData.fixedVarsVector);
+	if (mThermalVars.useReducedModel && mReducedModel.isBuilt() && solver.mode == 0)
+		mReducedModel.solve(solver, x, mThermalData.currentValueVector);
+	else
+		solver.solve(x, mThermalData.currentValueVector, mThermalTransport.getTransportMatrix(), mThermalData.fixedVarsVector);
+
+	if (mThermalVars.collectSnapshots && solver.mode == 0)
+		mReducedModel.addSnapshot(x);
 
 	if (solver.mode == 1)
 	{		
@@ -541,6 +694,50 @@ void ThermalRenderer::thermalTimestep()
 #endif !DISABLE_GUI
 }
 
+void ThermalRenderer::simulateAdaptive(const float* _output_times_hours, unsigned int _output_count, float* _vertex_temperatures, unsigned int _vertex_count)
+{
+	// _vertex_temperatures: vertices x outputs, row-major
+	const unsigned int n = mThermalData.currentValueVector.size();
+	if (solver.mode != 0)
+	{
+		spdlog::error("simulateAdaptive: only available in kelvin mode");
+		return;
+	}
+	if (_vertex_count != n)
+	{
+		spdlog::error("simulateAdaptive: vertex count {} does not match the scene ({})", _vertex_count, n);
+		return;
+	}
+
+	spdlog::stopwatch sw;
+	Map<Matrix<float, Eigen::Dynamic, Eigen::Dynamic, RowMajor>> out(_vertex_temperatures, n, _output_count);
+	Vec x = mThermalData.currentValueVector;
+	unsigned int steps = 0;
+	solver.adaptive_rejected = 0;
+	const SCALAR hour = 3600.0 * secondsUnitFactor;
+	for (unsigned int o = 0; o < _output_count; o++)
+	{
+		// steps are cut to land exactly on every output time
+		const SCALAR output_time = _output_times_hours[o] * hour;
+		while (output_time - mThermalVars.simulationTime > solver.adaptive_min_step * 1e-3)
+		{
+			mThermalVars.simulationTime += solver.adaptiveStep(x, output_time - mThermalVars.simulationTime, mThermalTransport.getTransportMatrix(), mThermalData.fixedVarsVector);
+			steps++;
+		}
+		mThermalVars.simulationTime = std::max(mThermalVars.simulationTime, output_time);
+		out.col(o) = (x / kelvinUnitFactor).cast<float>();
+	}
+	mThermalData.currentValueVector = x;
+
+	spdlog::info("simulateAdaptive() - time: {} h | steps: {}, rejected: {}, next step: {:.3} h | dur. {:.3} s", mThermalVars.simulationTime / hour,
+		steps, solver.adaptive_rejected, solver.adaptive_step / hour, sw);
+
+#ifndef DISABLE_GUI
+	SingleTimeCommand stc = mGetStcBuffer();
+	mThermalTransport.uploadValueVector(stc, mThermalData.currentValueVector);
+#endif !DISABLE_GUI
+}
+
 void ThermalRenderer::sceneUnload(scene_s scene) {
 
 	blas_gpu.unloadScene();
@@ -555,6 +752,8 @@ void ThermalRenderer::sceneUnload(scene_s scene) {
 #endif // !DISABLE_GUI
 
 	solver.reset();
+	mReducedModel.clear();
+	mReducedModel.clearSnapshots();
 	mThermalTransport.unload();
 	mThermalScene.unload();
 	mThermalData.unload();
@@ -589,6 +788,18 @@ void ThermalRenderer::drawView(viewDef_s* aViewDef) {
 		mThermalTransport.uploadValueVector(stc, mThermalData.currentValueVector);
 		mThermalVars.recomputeTransport = false;
 	}
+	if (mThermalVars.refineTransport)
+	{
+		resetSimulation();
+		refineTransportMatrix(mThermalVars.batchCount);
+		mThermalTransport.uploadValueVector(stc, mThermalData.currentValueVector);
+		mThermalVars.refineTransport = false;
+	}
+	if (mThermalVars.buildReducedModel)
+	{
+		buildReducedModel(mThermalVars.reducedRank, mThermalVars.reducedDeimRank);
+		mThermalVars.buildReducedModel = false;
+	}
 
 	CommandBuffer* cb = mGetCurrentCmdBuffer();
 	if (!aViewDef->surfaces.size()) {
@@ -623,6 +834,10 @@ void ThermalRenderer::drawView(viewDef_s* aViewDef) {
 			mThermalVars.remainingTimeSteps -= 1;
 	}
 
+	// only the column and row of the displayed source vertex live on the GPU
+	if (mThermalGui.visualization < 2)
+		mThermalTransport.uploadTransportSlice(stc, mThermalGui.sourceVertexId);
+
 	// aux ubo
 	AuxiliaryUbo aux_ubo;
 	aux_ubo.vertexCount = mThermalScene.getProperties().vertexCount;
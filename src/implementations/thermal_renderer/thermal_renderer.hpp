@@ -6,7 +6,9 @@
 #include "thermal_common.hpp"
 #include "thermal_scene.hpp"
 #include "thermal_transport.hpp"
+#include "thermal_cache.hpp"
 #include "thermal_solver.hpp"
+#include "thermal_reduced.hpp"
 #include "thermal_gui.hpp"
 
 #include "../../../assets/shader/raytracing_thermal/defines.h"
@@ -58,8 +60,13 @@ public:
 	//thermal
 	void				thermalInit(scene_s scene);
 	void				thermalTimestep();
+	void				simulateAdaptive(const float* _output_times_hours, unsigned int _output_count, float* _vertex_temperatures, unsigned int _vertex_count);
+	void				applyTransportSettings();
 	void				computeTransportMatrix();
+	void				refineTransportMatrix(unsigned int _batch_count);
 	void				resetSimulation();
+	bool				buildReducedModel(unsigned int _rank, unsigned int _deim_rank);
+	void				setReducedModel(bool _collect_snapshots, bool _use_reduced) { mThermalVars.collectSnapshots = _collect_snapshots; mThermalVars.useReducedModel = _use_reduced; };
 
 	void				computeSceneAABB();
 	glm::vec4			getBoundingSphere();
@@ -67,6 +74,8 @@ public:
 	void				getKelvin(float* _arr, unsigned int _count);
 	void				getValue(float* _arr, unsigned int _count, unsigned int _type);
 	void				setKelvin(float* _arr, unsigned int _triangle_count, unsigned int _vertex_offset, bool _sky_values);
+	bool				skyValuesToKelvin(RefModel_s* _sky, const float* _arr, unsigned int _quad_count, unsigned int _stride, Vec& _values, SCALAR& _avg_sky_value);
+	bool				solveSkyConditions(const float* _sky_values, unsigned int _quad_count, unsigned int _condition_count, float* _vertex_temperatures, unsigned int _vertex_count);
 	void				setTimeStep(float _hours);
 	void				setTime(float _hours);
 	float				getTimeHours();
@@ -75,8 +84,23 @@ public:
 		solver.compute_steady_state = _enabled;
 	};
 	void				setSolverMode(int _v) { solver.mode = _v; };
+	void				setTransportPrecision(int _precision) { solver.setTransportPrecision((TransportPrecision)_precision); };
+	void				setMixedPrecision(bool _enabled, unsigned int _refinement_steps) { solver.mixed_precision = _enabled; solver.refinement_steps = _refinement_steps; };
+	void				setSteadyStateSolver(bool _anderson, bool _warm_start) { solver.anderson_acceleration = _anderson; solver.warm_start = _warm_start; };
+	bool				setPreconditioner(int _type, bool _rebuild_per_step);
+	void				setMultigrid(unsigned int _coarse_size, unsigned int _smoother_steps) { solver.setMultigrid(_coarse_size, _smoother_steps); };
+	void				setExponentialIntegrator(bool _enabled, unsigned int _dense_limit) { solver.exponential_integrator = _enabled; solver.dense_exponential_limit = _dense_limit; solver.compute_steady_state = !_enabled; };
+	void				getSolverStatistics(unsigned int* _iterations, unsigned int* _krylov_iterations, float* _seconds) { *_iterations = solver.solve_iterations; *_krylov_iterations = solver.krylov_iterations; *_seconds = solver.solve_seconds; };
+	void				setAdaptiveTolerance(float _relative, float _absolute_kelvin) { solver.adaptive_rtol = _relative; solver.adaptive_atol = _absolute_kelvin * kelvinUnitFactor; };
 	void				setRayBatchCount(unsigned int _ray_count, unsigned int _batch_count) { mThermalVars.rayCount = _ray_count; mThermalVars.batchCount = _batch_count; };
+	void				setTargetRelativeError(float _error) { mThermalVars.targetRelativeError = _error; };
+	void				setCpuTransport(bool _enabled) { mThermalVars.cpuTransport = _enabled; };
+	void				setReciprocalTransport(bool _enabled) { mThermalVars.reciprocalTransport = _enabled; };
+	void				setTransportSampler(int _sampler) { mThermalVars.transportSampler = _sampler; };
+	void				setRayAllocation(bool _proportional, unsigned int _min_rays) { mThermalVars.proportionalRays = _proportional; mThermalVars.minTriangleRays = _min_rays; };
+	const ThermalTransport::ReciprocityReport_s& getReciprocityReport() { return mThermalTransport.getReciprocityReport(); };
 	void				temporaryDisableTransportCompute() { mDisableCompute = true; };
+	void				setTransportCache(bool _enabled, const std::string& _directory) { mThermalCache.enabled = _enabled; mThermalCache.directory = _directory; };
 
 	unsigned int		sky_vertex_offset = 0;
 	unsigned int		sky_vertex_count = 0;
@@ -130,6 +154,7 @@ private:
 	std::vector<VkFrameData>								mVkFrameData;
 
 	ThermalSolver											solver;
+	ThermalReducedModel										mReducedModel;
 
 	std::vector<Vector3f>									sunDirections;
 	bool													createSunAndSky = false;
@@ -144,6 +169,7 @@ private:
 	ThermalScene mThermalScene;
 	ThermalData mThermalData;
 	ThermalTransport mThermalTransport;
+	ThermalCache mThermalCache;
 	ThermalGui mThermalGui;
 
 	ThermalVars_s mThermalVars;
@@ -3,6 +3,7 @@
 #include <iostream>
 
 #include "spdlog/spdlog.h"
+#include <spdlog/stopwatch.h>
 
 // System headers
 #include <iostream>
@@ -11,103 +12,730 @@
 #include <Eigen/Core>
 #include <Eigen/Sparse>
 
+#include <algorithm>
+#include <numeric>
+#include <map>
+#include <tuple>
+#include <limits>
+
 // think about (m * x^3)^-1 = (x^3)^-1 * m^-1 precompute m^-1  
 
-Vec ThermalSolver::residual(const Vec& x, const Vec& _currentKelvin, const Mat& _transportMatrix, const Vec& _fixedVars) {
-	Vec _x = x;
-	_x = (_fixedVars.array() < 1.0).select(_x, _currentKelvin);
-	Vec res;
-	if (compute_steady_state)
-		res = step_size * _transportMatrix * _x.array().pow(4.0).matrix();
-	else
-		res = _currentKelvin + step_size * _transportMatrix * _x.array().pow(4.0).matrix() - _x;
-	res = (_fixedVars.array() < 1.0).select(res, 0.0);
+// reverse Cuthill-McKee on the symmetrized pattern of the free rows, returns the new order of the free variables
+static std::vector<int> reverseCuthillMcKee(const SpMat& _transportMatrix, const std::vector<int>& _free, const std::vector<int>& _local, const Vec& _fixedVars)
+{
+	const int n = _free.size();
+
+	// adjacency of A + A^T without the diagonal, as CSR
+	std::vector<int> degree(n, 0);
+	for (int r = 0; r < n; r++)
+		for (SpMat::InnerIterator it(_transportMatrix, _free[r]); it; ++it)
+			if (_fixedVars[it.col()] <= 0.0 && _local[it.col()] != r)
+			{
+				degree[r]++;
+				degree[_local[it.col()]]++;
+			}
+	std::vector<int64_t> offset(n + 1, 0);
+	for (int r = 0; r < n; r++)
+		offset[r + 1] = offset[r] + degree[r];
+	std::vector<int> adjacency(offset[n]);
+	std::vector<int64_t> fill(offset.begin(), offset.end() - 1);
+	for (int r = 0; r < n; r++)
+		for (SpMat::InnerIterator it(_transportMatrix, _free[r]); it; ++it)
+			if (_fixedVars[it.col()] <= 0.0 && _local[it.col()] != r)
+			{
+				const int c = _local[it.col()];
+				adjacency[fill[r]++] = c;
+				adjacency[fill[c]++] = r;
+			}
+
+	// breadth first from a minimum degree vertex per connected component, neighbors by increasing degree
+	std::vector<int> by_degree(n);
+	std::iota(by_degree.begin(), by_degree.end(), 0);
+	std::stable_sort(by_degree.begin(), by_degree.end(), [&](int a, int b) { return degree[a] < degree[b]; });
+	std::vector<int> order;
+	order.reserve(n);
+	std::vector<bool> visited(n, false);
+	std::vector<int> neighbors;
+	for (int start : by_degree)
+	{
+		if (visited[start])
+			continue;
+		visited[start] = true;
+		size_t head = order.size();
+		order.push_back(start);
+		while (head < order.size())
+		{
+			const int v = order[head++];
+			neighbors.clear();
+			for (int64_t k = offset[v]; k < offset[v + 1]; k++)
+				if (!visited[adjacency[k]])
+				{
+					visited[adjacency[k]] = true;
+					neighbors.push_back(adjacency[k]);
+				}
+			std::sort(neighbors.begin(), neighbors.end(), [&](int a, int b) { return degree[a] < degree[b]; });
+			order.insert(order.end(), neighbors.begin(), neighbors.end());
+		}
+	}
+	std::reverse(order.begin(), order.end());
+	return order;
+}
+
+static int64_t bandwidth(const SpMat& _matrix)
+{
+	int64_t b = 0;
+	for (int r = 0; r < _matrix.outerSize(); r++)
+		for (SpMat::InnerIterator it(_matrix, r); it; ++it)
+			b = std::max<int64_t>(b, std::abs(int64_t(it.col()) - r));
+	return b;
+}
+
+void ThermalSolver::partition(const SpMat& _transportMatrix, const Vec& _fixedVars)
+{
+	const int size = _transportMatrix.rows();
+	freeIndices.clear();
+	fixedIndices.clear();
+
+	// position of every variable within its partition
+	std::vector<int> local(size);
+	freeBlocks.clear();
+	for (int k = 0; k < size; k++)
+	{
+		if (_fixedVars[k] > 0.0)
+		{
+			local[k] = fixedIndices.size();
+			fixedIndices.push_back(k);
+		}
+		else
+		{
+			local[k] = freeIndices.size();
+			freeIndices.push_back(k);
+			freeBlocks.push_back(k < (int)vertexBlocks.size() ? vertexBlocks[k] : 0);
+		}
+	}
+
+	// vertex indices follow the scene traversal, reordering the free variables keeps coupled vertices close in memory
+	if (reorder_free && !freeIndices.empty())
+	{
+		std::vector<int> order = reverseCuthillMcKee(_transportMatrix, freeIndices, local, _fixedVars);
+		std::vector<int> indices(order.size());
+		std::vector<int> blocks(order.size());
+		for (size_t k = 0; k < order.size(); k++)
+		{
+			indices[k] = freeIndices[order[k]];
+			blocks[k] = freeBlocks[order[k]];
+			local[indices[k]] = k;
+		}
+		freeIndices.swap(indices);
+		freeBlocks.swap(blocks);
+	}
+
+	std::vector<Triplet<SCALAR>> free_triplets;
+	std::vector<Triplet<SCALAR>> coupling_triplets;
+	for (int r = 0; r < (int)freeIndices.size(); r++)
+	{
+		for (SpMat::InnerIterator it(_transportMatrix, freeIndices[r]); it; ++it)
+		{
+			if (_fixedVars[it.col()] > 0.0)
+				coupling_triplets.emplace_back(r, local[it.col()], it.value());
+			else
+				free_triplets.emplace_back(r, local[it.col()], it.value());
+		}
+	}
+
+	freeMatrix = SpMat(freeIndices.size(), freeIndices.size());
+	freeMatrix.setFromTriplets(free_triplets.begin(), free_triplets.end());
+	freeOperator.setMatrix(&freeMatrix, transport_precision);
+	couplingMatrix = SpMat(freeIndices.size(), fixedIndices.size());
+	couplingMatrix.setFromTriplets(coupling_triplets.begin(), coupling_triplets.end());
+	fixedValues.resize(0);
+	precond.clear();
+	buildHierarchy();
+	partitioned = true;
+
+	spdlog::info("ThermalSolver - partitioned {} free and {} fixed variables (T_ff bandwidth: {}{})", freeIndices.size(), fixedIndices.size(), bandwidth(freeMatrix), reorder_free ? ", RCM ordered" : "");
+}
+
+void ThermalSolver::updateFixedValues(const Vec& _currentKelvin)
+{
+	Vec values(fixedIndices.size());
+	for (int k = 0; k < (int)fixedIndices.size(); k++)
+		values[k] = _currentKelvin[fixedIndices[k]];
+
+	// only changes when fixed temperatures (e.g. sky values) are updated
+	if (values.size() == fixedValues.size() && values == fixedValues)
+		return;
+
+	fixedValues = values;
+	fixedRhs = couplingMatrix * fixedValues.array().pow(4.0).matrix();
+	fixedRhsDouble = couplingMatrix.cast<double>() * fixedValues.cast<double>().array().pow(4.0).matrix();
+}
+
+Vec ThermalSolver::residual(const Vec& x, const Vec& _currentKelvin) {
+	Vec tx4;
+	freeOperator.apply(x.array().pow(4.0).matrix(), tx4);
+	Vec res = step_size * (tx4 + fixedRhs);
+	if (!compute_steady_state)
+		res += _currentKelvin - x;
 	return res;
 }
 
-void ThermalSolver::jacobian(const Vec& x, Mat& jac, const Mat& _transportMatrix, const Vec& _fixedVars) {
+void ThermalSolver::jacobian(const Vec& x, SpMat& jac) {
 
 	int size = x.size();
 	Vec diag = 4.0 * x.array().pow(3.0);
 
-	//diag = (fixedVars.array() < 1.0).select(diag, 1.0);
-
-	jac = step_size * DiagonalMatrix<SCALAR, Eigen::Dynamic>(diag) * _transportMatrix;
+	jac = freeMatrix * (step_size * diag).asDiagonal();
 
 	if (!compute_steady_state)
-		jac.diagonal() -= Vec::Ones(size);
+	{
+		SpMat identity(size, size);
+		identity.setIdentity();
+		jac -= identity;
+	}
+	jac.makeCompressed();
+}
+
+void JacobianOperator::apply(const Vec& v, Vec& out) const
+{
+	transport->apply(derivative.cwiseProduct(v), out, parallel);
+	if (subtractIdentity)
+		out -= v;
+}
+
+void ThermalSolver::jacobianOperator(const Vec& x, JacobianOperator& op)
+{
+	op.transport = &freeOperator;
+	op.derivative = step_size * 4.0 * x.array().pow(3.0);
+	op.subtractIdentity = !compute_steady_state;
+}
+
+void ThermalSolver::reset()
+{
+	jac.setZero();
+	partitioned = false;
+	precond.clear();
+	expOperatorValid = false;
+	expOperatorDouble = SparseMatrix<double, RowMajor>();
+	denseExponentialStep = -1;
+	krylovStep = -1;
+	steadyHistory.clear();
+}
+
+void ThermalSolver::applyExponential(Vec& x, const SpMat& _transportMatrix, const Vec& _fixedVars)
+{
+	if (!expOperatorValid || expOperator.rows() != _transportMatrix.rows())
+	{
+		// fixed variables do not change over time
+		Vec free = (_fixedVars.array() > 0.0).select(Vec::Zero(x.size()), Vec::Ones(x.size()));
+		expOperator = free.asDiagonal() * _transportMatrix;
+		expOperatorDouble = expOperator.cast<double>();
+		expOperatorValid = true;
+		denseExponentialStep = -1;
+		krylovStep = -1;
+	}
 
-	for (int i = 0; i < size; i++)
-		if (_fixedVars[i] > 0.0) {
-			jac.row(i).setConstant(0.0);
-			jac.col(i).setConstant(0.0);
-			jac(i, i) = 1.0;
+	if (x.size() <= (int)dense_exponential_limit)
+	{
+		if (denseExponentialStep != step_size)
+		{
+			spdlog::stopwatch sw;
+			MatrixXd a = MatrixXd(expOperatorDouble) * double(step_size);
+			denseExponential = a.exp().cast<SCALAR>();
+			denseExponentialStep = step_size;
+			spdlog::info("ThermalSolver - dense exponential {} x {} (dur. {:.3} s)", x.size(), x.size(), sw);
 		}
+		x = denseExponential * x;
 	}
+	else
+	{
+		krylovExpmv(x, step_size);
+	}
+}
 
-void ThermalSolver::reset()
+void ThermalSolver::krylovExpmv(Vec& _x, SCALAR _t)
+{
+	const int n = _x.size();
+	const int m = std::min<int>(krylov_dimension, n);
+	krylovBasis.resize(n, m + 1);
+	krylovHessenberg.resize(m + 1, m);
+
+	VectorXd x = _x.cast<double>();
+	double t = 0;
+	double tau = krylovStep > 0 ? std::min<double>(krylovStep, _t) : _t;
+	int substeps = 0;
+	while (t < _t)
+	{
+		tau = std::min<double>(tau, _t - t);
+		double beta = x.norm();
+		if (beta == 0.0)
+			break;
+
+		// Arnoldi
+		krylovHessenberg.setZero();
+		krylovBasis.col(0) = x / beta;
+		int k = m;
+		bool breakdown = false;
+		for (int j = 0; j < m; j++)
+		{
+			VectorXd w = expOperatorDouble * krylovBasis.col(j);
+			for (int i = 0; i <= j; i++)
+			{
+				krylovHessenberg(i, j) = krylovBasis.col(i).dot(w);
+				w -= krylovHessenberg(i, j) * krylovBasis.col(i);
+			}
+			krylovHessenberg(j + 1, j) = w.norm();
+			if (krylovHessenberg(j + 1, j) < 1e-12 * beta)
+			{
+				// the subspace is invariant, the result is exact
+				k = j + 1;
+				breakdown = true;
+				break;
+			}
+			krylovBasis.col(j + 1) = w / krylovHessenberg(j + 1, j);
+		}
+
+		// shrink the substep until the a posteriori error estimate is met
+		while (true)
+		{
+			MatrixXd e = (tau * krylovHessenberg.topLeftCorner(k, k)).exp();
+			double error = breakdown ? 0.0 : beta * std::abs(krylovHessenberg(k, k - 1) * e(k - 1, 0));
+			if (error <= krylov_tolerance * beta || tau < 1e-12 * _t)
+			{
+				x = beta * krylovBasis.leftCols(k) * e.col(0);
+				t += tau;
+				substeps++;
+				krylovStep = tau;
+				if (error < 0.1 * krylov_tolerance * beta)
+					tau *= 2.0;
+				break;
+			}
+			tau *= 0.5;
+		}
+	}
+
+	_x = x.cast<SCALAR>();
+	spdlog::info("ThermalSolver - Krylov expmv: {} substeps (dimension {})", substeps, m);
+}
+
+void ThermalSolver::setTransportPrecision(TransportPrecision _precision)
+{
+	transport_precision = _precision;
+	if (partitioned)
+		freeOperator.setPrecision(_precision);
+}
+
+void ThermalSolver::preparePartition(const SpMat& _transportMatrix, const Vec& _fixedVars)
+{
+	if (!partitioned || freeIndices.size() + fixedIndices.size() != _fixedVars.size())
+		partition(_transportMatrix, _fixedVars);
+}
+
+void ThermalSolver::setBlocks(const std::vector<unsigned int>& _vertexOffset, const std::vector<unsigned int>& _vertexCount)
+{
+	vertexBlocks.clear();
+	for (size_t i = 0; i < _vertexOffset.size(); i++)
+	{
+		if (vertexBlocks.size() < _vertexOffset[i] + _vertexCount[i])
+			vertexBlocks.resize(_vertexOffset[i] + _vertexCount[i], 0);
+		std::fill(vertexBlocks.begin() + _vertexOffset[i], vertexBlocks.begin() + _vertexOffset[i] + _vertexCount[i], (int)i);
+	}
+	partitioned = false;
+}
+
+void ThermalSolver::setGeometry(const Mat& _positions, const Vec& _areas)
 {
-	jac.setConstant(0);
+	vertexPositions = _positions;
+	vertexAreas = _areas;
+	partitioned = false;
 }
 
-void ThermalSolver::solve(Vec& x, const Vec& _currentKelvin, const Mat& _transportMatrix, const Vec& _fixedVars)
+void ThermalSolver::setMultigrid(unsigned int _coarse_size, unsigned int _smoother_steps)
 {
-	unsigned int vsize = x.rows() * x.cols();
-	jac = Mat(vsize, vsize);
-	dx = Vec(vsize);
-	res = Vec(vsize);
-	x_alpha_res = Vec(vsize);
-	prev_x = x;
-	prev_res = residual(x, _currentKelvin, _transportMatrix, _fixedVars);
+	multigrid_coarse_size = std::max(1u, _coarse_size);
+	precond.smootherSteps = std::max(1u, _smoother_steps);
+	if (partitioned)
+		buildHierarchy();
+	precond.clear();
+}
+
+void ThermalSolver::buildHierarchy()
+{
+	precond.hierarchy.clear();
+	const int size = freeIndices.size();
+	if (vertexPositions.rows() < (int)(freeIndices.size() + fixedIndices.size()) || size == 0)
+		return;
 
+	// level 0 are the free variables
+	Mat positions(size, 3);
+	Vec areas(size);
+	std::vector<int> blocks = freeBlocks;
+	for (int k = 0; k < size; k++)
+	{
+		positions.row(k) = vertexPositions.row(freeIndices[k]);
+		areas[k] = std::max<SCALAR>(vertexAreas[freeIndices[k]], std::numeric_limits<SCALAR>::min());
+	}
+
+	while (positions.rows() > (int)multigrid_coarse_size && precond.hierarchy.size() < 16)
+	{
+		// surface clusters: cell edge such that a cell covers about multigrid_cluster_size vertex areas
+		const int n = positions.rows();
+		const double cell = std::sqrt(multigrid_cluster_size * areas.sum() / n);
+		std::map<std::tuple<int, int64_t, int64_t, int64_t>, int> cells;
+		ThermalPreconditioner::Aggregation_s level;
+		level.aggregate.resize(n);
+		for (int k = 0; k < n; k++)
+		{
+			auto key = std::make_tuple(blocks[k],
+				(int64_t)std::floor(positions(k, 0) / cell), (int64_t)std::floor(positions(k, 1) / cell), (int64_t)std::floor(positions(k, 2) / cell));
+			auto it = cells.emplace(key, (int)cells.size()).first;
+			level.aggregate[k] = it->second;
+		}
+		const int coarse = cells.size();
+		if (coarse > 0.8 * n)
+			break;
+
+		// area weighted cluster centers
+		Mat coarse_positions = Mat::Zero(coarse, 3);
+		Vec coarse_areas = Vec::Zero(coarse);
+		std::vector<int> coarse_blocks(coarse);
+		for (int k = 0; k < n; k++)
+		{
+			const int c = level.aggregate[k];
+			coarse_positions.row(c) += areas[k] * positions.row(k);
+			coarse_areas[c] += areas[k];
+			coarse_blocks[c] = blocks[k];
+		}
+		coarse_positions = coarse_areas.cwiseInverse().asDiagonal() * coarse_positions;
+
+		level.fineArea = areas;
+		level.coarseArea = coarse_areas;
+		precond.hierarchy.push_back(std::move(level));
+		positions = coarse_positions;
+		areas = coarse_areas;
+		blocks = coarse_blocks;
+	}
+
+	std::string sizes = std::to_string(size);
+	for (const ThermalPreconditioner::Aggregation_s& level : precond.hierarchy)
+		sizes += " -> " + std::to_string(level.coarseArea.size());
+	spdlog::info("ThermalSolver - multigrid hierarchy: {}", sizes);
+}
+
+void ThermalPreconditioner::build(Type _type, const SpMat& _jacobian, const std::vector<int>& _blocks)
+{
+	type = _type;
+	const int size = _jacobian.rows();
+
+	if (type == JACOBI)
+	{
+		buildJacobi(_jacobian.diagonal());
+	}
+	else if (type == BLOCK_JACOBI)
+	{
+		// couplings between objects are dropped, the remaining block diagonal matrix is factorized exactly
+		std::vector<Triplet<SCALAR>> triplets;
+		for (int r = 0; r < size; r++)
+			for (SpMat::InnerIterator it(_jacobian, r); it; ++it)
+				if (_blocks[r] == _blocks[it.col()])
+					triplets.emplace_back(r, it.col(), it.value());
+		SparseMatrix<SCALAR> blocks(size, size);
+		blocks.setFromTriplets(triplets.begin(), triplets.end());
+		blockLU.compute(blocks);
+		if (blockLU.info() != Success)
+		{
+			spdlog::warn("ThermalPreconditioner - block factorization failed, falling back to Jacobi");
+			build(JACOBI, _jacobian, _blocks);
+			return;
+		}
+	}
+	else if (type == MULTIGRID)
+	{
+		if (hierarchy.empty())
+		{
+			spdlog::warn("ThermalPreconditioner - no multigrid hierarchy (geometry not set or system too small), falling back to Jacobi");
+			build(JACOBI, _jacobian, _blocks);
+			return;
+		}
+
+		// coarse operators A_c = R * A * P, R = diag(1 / area_c) * P^T * diag(area_f)
+		levelMatrix.assign(1, _jacobian);
+		levelInvDiagonal.clear();
+		restriction.clear();
+		prolongation.clear();
+		for (const Aggregation_s& level : hierarchy)
+		{
+			const int fine = level.aggregate.size();
+			const int coarse = level.coarseArea.size();
+			std::vector<Triplet<SCALAR>> p_triplets;
+			std::vector<Triplet<SCALAR>> r_triplets;
+			for (int k = 0; k < fine; k++)
+			{
+				p_triplets.emplace_back(k, level.aggregate[k], 1.0);
+				r_triplets.emplace_back(level.aggregate[k], k, level.fineArea[k] / level.coarseArea[level.aggregate[k]]);
+			}
+			SpMat p(fine, coarse);
+			p.setFromTriplets(p_triplets.begin(), p_triplets.end());
+			SpMat r(coarse, fine);
+			r.setFromTriplets(r_triplets.begin(), r_triplets.end());
+
+			const SpMat& a = levelMatrix.back();
+			Vec diagonal = a.diagonal();
+			levelInvDiagonal.push_back((diagonal.array() != 0.0).select(diagonal.cwiseInverse(), 1.0));
+			SpMat coarse_matrix = r * a * p;
+			levelMatrix.push_back(coarse_matrix);
+			restriction.push_back(std::move(r));
+			prolongation.push_back(std::move(p));
+		}
+		coarseLU.compute(SparseMatrix<SCALAR>(levelMatrix.back()));
+		if (coarseLU.info() != Success)
+		{
+			spdlog::warn("ThermalPreconditioner - coarse factorization failed, falling back to Jacobi");
+			build(JACOBI, _jacobian, _blocks);
+			return;
+		}
+	}
+	else if (type == ILUT)
+	{
+		// small radiative couplings add fill without improving the preconditioner
+		SpMat sparsified = _jacobian;
+		Vec diagonal = _jacobian.diagonal().cwiseAbs();
+		sparsified.prune([&](const Index& r, const Index& c, const SCALAR& v) {
+			return r == c || std::abs(v) > sparsifyTolerance * diagonal[r];
+		});
+		ilut.setDroptol(dropTolerance);
+		ilut.setFillfactor(fillFactor);
+		ilut.compute(SparseMatrix<SCALAR>(sparsified));
+		if (ilut.info() != Success)
+		{
+			spdlog::warn("ThermalPreconditioner - ILUT failed, falling back to Jacobi");
+			build(JACOBI, _jacobian, _blocks);
+			return;
+		}
+	}
+	built = true;
+}
+
+void ThermalPreconditioner::buildJacobi(const Vec& _diagonal)
+{
+	type = JACOBI;
+	invDiagonal = (_diagonal.array() != 0.0).select(_diagonal.cwiseInverse(), 1.0);
+	built = true;
+}
+
+Vec ThermalPreconditioner::apply(const Vec& b) const
+{
+	switch (type)
+	{
+	case JACOBI: return invDiagonal.cwiseProduct(b);
+	case BLOCK_JACOBI: return blockLU.solve(b);
+	case ILUT: return ilut.solve(b);
+	case MULTIGRID: return vcycle(0, b);
+	default: return b;
+	}
+}
+
+Vec ThermalPreconditioner::vcycle(size_t _level, const Vec& b) const
+{
+	if (_level == restriction.size())
+		return coarseLU.solve(b);
+
+	// fixed number of damped Jacobi sweeps keeps the cycle linear in b, as required by BiCGSTAB
+	const SpMat& a = levelMatrix[_level];
+	const Vec& inv_diagonal = levelInvDiagonal[_level];
+	Vec x = smootherDamping * inv_diagonal.cwiseProduct(b);
+	for (int s = 1; s < smootherSteps; s++)
+		x += smootherDamping * inv_diagonal.cwiseProduct(b - a * x);
+
+	Vec coarse_b = restriction[_level] * (b - a * x);
+	x += prolongation[_level] * vcycle(_level + 1, coarse_b);
+
+	for (int s = 0; s < smootherSteps; s++)
+		x += smootherDamping * inv_diagonal.cwiseProduct(b - a * x);
+	return x;
+}
+
+void ThermalSolver::preparePreconditioner(const Vec& x)
+{
+	if (preconditioner == ThermalPreconditioner::NONE)
+	{
+		precond.clear();
+		return;
+	}
+	if (precond.built && precond.type == preconditioner && !rebuild_preconditioner)
+		return;
+
+	spdlog::stopwatch sw;
+	if (preconditioner == ThermalPreconditioner::JACOBI)
+	{
+		// diag(J) = step_size * 4x^3 .* diag(T_ff) (- 1), no need to assemble J
+		Vec diagonal = freeMatrix.diagonal();
+		diagonal.array() *= step_size * 4.0 * x.array().pow(3.0);
+		if (!compute_steady_state)
+			diagonal.array() -= 1.0;
+		precond.buildJacobi(diagonal);
+	}
+	else
+	{
+		SpMat j;
+		jacobian(x, j);
+		precond.build(preconditioner, j, freeBlocks);
+	}
+	spdlog::info("ThermalSolver - preconditioner {} built (dur. {:.3} s)", (int)precond.type, sw);
+}
+
+void ThermalSolver::solve(Vec& _x, const Vec& _currentKelvin, const SpMat& _transportMatrix, const Vec& _fixedVars)
+{
 	if (mode == 1)
 	{
-		// TODO: only compute 
-		x = _transportMatrix * x;
+		if (exponential_integrator && !compute_steady_state)
+			applyExponential(_x, _transportMatrix, _fixedVars);
+		else
+			_x = _transportMatrix * _x;
 		return;
 	}
 
-	for (int i = 0; i < max_iter; i++)
+	preparePartition(_transportMatrix, _fixedVars);
+	updateFixedValues(_currentKelvin);
+
+	// reduce to the free variables
+	unsigned int vsize = freeIndices.size();
+	Vec x(vsize);
+	Vec current(vsize);
+	for (unsigned int k = 0; k < vsize; k++)
+	{
+		x[k] = _x[freeIndices[k]];
+		current[k] = _currentKelvin[freeIndices[k]];
+	}
+
+	spdlog::stopwatch sw;
+	const bool steady_state = compute_steady_state;
+	if (steady_state && warm_start)
+		extrapolateSteadyState(x);
+
+	if (steady_state && anderson_acceleration)
+		solveAnderson(x);
+	else if (mixed_precision)
+		solveNewtonMixed(x, current);
+	else
+		solveNewton(x, current);
+	solve_seconds = sw.elapsed().count();
+
+	if (steady_state && warm_start)
 	{
-		res = residual(x, _currentKelvin, _transportMatrix, _fixedVars);
-		jacobian(x, jac, _transportMatrix, _fixedVars);
+		steadyHistory.push_back(x);
+		if (steadyHistory.size() > warm_start_history)
+			steadyHistory.erase(steadyHistory.begin());
+	}
 
-		//spdlog::debug("jac:\n{}", jac);
+	// fixed variables keep their current values
+	for (unsigned int k = 0; k < vsize; k++)
+		_x[freeIndices[k]] = x[k];
+	for (int k : fixedIndices)
+		_x[k] = _currentKelvin[k];
+}
+
+void ThermalSolver::evaluateResidual(const Vec& x, const Vec& _current, Vec& x4, Vec& tx4, Vec& out)
+{
+	// x^4 once per candidate, T_ff * x^4 kept for the caller
+	x4 = x.array().square().square();
+	freeOperator.apply(x4, tx4);
+	out = step_size * (tx4 + fixedRhs);
+	if (!compute_steady_state)
+		out += _current - x;
+}
+
+void ThermalSolver::SolverWorkspace::resize(int _size)
+{
+	if (dx.size() == _size)
+		return;
+	for (Vec* v : { &dx, &res, &prev_x, &prev_res, &x4, &tx4, &x_alpha, &x_alpha4, &tx_alpha4, &res_alpha })
+		v->resize(_size);
+}
+
+void ThermalSolver::solveNewton(Vec& x, const Vec& current)
+{
+	SolverWorkspace& w = workspace;
+	w.resize(x.size());
+
+	// the residual of the accepted line search candidate is the residual of the next iterate
+	evaluateResidual(x, current, w.x4, w.tx4, w.res);
+	w.prev_x = x;
+	w.prev_res = w.res;
+
+	preparePreconditioner(x);
+	const ThermalPreconditioner* active_precond = precond.built ? &precond : nullptr;
+	solver.preconditioner().source = active_precond;
+	mf_solver.preconditioner().source = active_precond;
+	krylov_iterations = 0;
+	solve_iterations = 0;
+
+	for (int i = 0; i < max_iter; i++)
+	{
 		//spdlog::debug("x:\n{}", x);
-		//spdlog::debug("res:\n{}", res);
+		//spdlog::debug("res:\n{}", w.res);
 
-		solver.compute(jac);
-		dx = -solver.solve(res);
+		Eigen::ComputationInfo info;
+		Index iterations = 0;
+		if (matrix_free)
+		{
+			jacobianOperator(x, jac_op);
+			mf_solver.compute(jac_op);
+			w.dx = mf_solver.solve(w.res);
+			info = mf_solver.info();
+			iterations = mf_solver.iterations();
+		}
+		else
+		{
+			jacobian(x, jac);
+			//spdlog::debug("jac:\n{}", jac);
+			solver.compute(jac);
+			w.dx = solver.solve(w.res);
+			info = solver.info();
+			iterations = solver.iterations();
+		}
+		w.dx = -w.dx;
+		krylov_iterations += iterations;
+		solve_iterations++;
 
-		if (solver.info() == Eigen::ComputationInfo::NoConvergence)
+		if (info == Eigen::ComputationInfo::NoConvergence)
 		{
-			spdlog::error("Eigen::ComputationInfo::NoConvergence");
+			spdlog::error("Eigen::ComputationInfo::NoConvergence (krylov iterations: {})", iterations);
 			//break;
 		}
-		//spdlog::debug("dx:\n{}", dx);
-		//spdlog::debug("norm: {}", (jac * dx + residual(x)).squaredNorm());
+		//spdlog::debug("dx:\n{}", w.dx);
 
-		// line search
+		// line search, bounded
 		SCALAR alpha = 1.0;
-		x_alpha_res = residual(x + alpha * dx, _currentKelvin, _transportMatrix, _fixedVars);
-		SCALAR res_norm = res.squaredNorm();
-		SCALAR x_alpha_norm = x_alpha_res.squaredNorm();
-		while (res_norm < x_alpha_norm) // limit to 20 iters
+		SCALAR res_norm = w.res.squaredNorm();
+		SCALAR x_alpha_norm = 0.0;
+		for (unsigned int ls = 0; ; ls++)
 		{
+			w.x_alpha = x + alpha * w.dx;
+			evaluateResidual(w.x_alpha, current, w.x_alpha4, w.tx_alpha4, w.res_alpha);
+			x_alpha_norm = w.res_alpha.squaredNorm();
+			if (x_alpha_norm <= res_norm || isnan(x_alpha_norm))
+				break;
+			if (ls + 1 >= max_line_search)
+			{
+				spdlog::warn("ThermalSolver - line search limit reached (alpha: {})", alpha);
+				break;
+			}
 			alpha *= 0.5;
-			x_alpha_res = residual(x + alpha * dx, _currentKelvin, _transportMatrix, _fixedVars);
-			x_alpha_norm = x_alpha_res.squaredNorm();
 		}
 
-		x += alpha * dx;
+		// accept the candidate, its residual and T_ff * x^4 carry over
+		x.swap(w.x_alpha);
+		w.x4.swap(w.x_alpha4);
+		w.tx4.swap(w.tx_alpha4);
+		w.res.swap(w.res_alpha);
 
-		res = residual(x, _currentKelvin, _transportMatrix, _fixedVars);
-		res_norm = res.squaredNorm();
-		SCALAR dx_norm = (x - prev_x).squaredNorm();
-		SCALAR dres_norm = (res - prev_res).squaredNorm();
-		
-		prev_x = x;
-		prev_res = residual(x, _currentKelvin, _transportMatrix, _fixedVars);
+		res_norm = x_alpha_norm;
+		SCALAR dx_norm = (x - w.prev_x).squaredNorm();
+		SCALAR dres_norm = (w.res - w.prev_res).squaredNorm();
+
+		w.prev_x = x;
+		w.prev_res = w.res;
 
 		if (isnan(res_norm))
 		{
@@ -115,7 +743,7 @@ void ThermalSolver::solve(Vec& x, const Vec& _currentKelvin, const Mat& _transpo
 			break;
 		}
 
-		spdlog::info("ThermalSolver - iter: {}/{}, res_norm: {}, dres_norm: {} <> {} (f_tol), dx_norm: {} <> {} (x_tol), alpha: {} <> {} (a_tol)", i, max_iter, res_norm, dres_norm, f_tol, dx_norm, x_tol, alpha, a_tol);
+		spdlog::info("ThermalSolver - iter: {}/{}, res_norm: {}, dres_norm: {} <> {} (f_tol), dx_norm: {} <> {} (x_tol), alpha: {} <> {} (a_tol), krylov iters: {}", i, max_iter, res_norm, dres_norm, f_tol, dx_norm, x_tol, alpha, a_tol, iterations);
 
 		if (dres_norm < f_tol && dx_norm < x_tol)
 		{
@@ -126,4 +754,412 @@ void ThermalSolver::solve(Vec& x, const Vec& _currentKelvin, const Mat& _transpo
 		}
 		
 	}
-}
\ No newline at end of file
+}
+
+void ThermalSolver::evaluateResidual(const VectorXd& x, const VectorXd& _current, VectorXd& out)
+{
+	VectorXd tx4;
+	freeOperator.apply(VectorXd(x.array().square().square()), tx4);
+	out = double(step_size) * (tx4 + fixedRhsDouble);
+	if (!compute_steady_state)
+		out += _current - x;
+}
+
+void ThermalSolver::solveNewtonMixed(Vec& _x, const Vec& _current)
+{
+	// float storage, matvecs and Krylov solves, double iterate and residuals, the correction is refined against the double Jacobian
+	VectorXd x = _x.cast<double>();
+	const VectorXd current = _current.cast<double>();
+	VectorXd res, res_alpha, x_alpha, dx, lin_res, tmp;
+	evaluateResidual(x, current, res);
+	VectorXd prev_x = x;
+	VectorXd prev_res = res;
+
+	preparePreconditioner(_x);
+	const ThermalPreconditioner* active_precond = precond.built ? &precond : nullptr;
+	solver.preconditioner().source = active_precond;
+	mf_solver.preconditioner().source = active_precond;
+	krylov_iterations = 0;
+	solve_iterations = 0;
+
+	Vec xf = _x;
+	Vec rhs, correction;
+	for (int i = 0; i < max_iter; i++)
+	{
+		// float Jacobian at the current iterate
+		xf = x.cast<SCALAR>();
+		if (matrix_free)
+		{
+			jacobianOperator(xf, jac_op);
+			mf_solver.compute(jac_op);
+		}
+		else
+		{
+			jacobian(xf, jac);
+			solver.compute(jac);
+		}
+		auto solveLinear = [&](const VectorXd& _rhs) {
+			// normalized right-hand side, small refinement residuals would underflow in float
+			const double scale = _rhs.norm();
+			if (scale == 0.0)
+				return VectorXd(VectorXd::Zero(_rhs.size()));
+			rhs = (_rhs / scale).cast<SCALAR>();
+			correction = matrix_free ? Vec(mf_solver.solve(rhs)) : Vec(solver.solve(rhs));
+			krylov_iterations += matrix_free ? mf_solver.iterations() : solver.iterations();
+			if ((matrix_free ? mf_solver.info() : solver.info()) == Eigen::ComputationInfo::NoConvergence)
+				spdlog::error("Eigen::ComputationInfo::NoConvergence (krylov iterations: {})", matrix_free ? mf_solver.iterations() : solver.iterations());
+			if (correction.hasNaN())
+				return VectorXd(VectorXd::Zero(_rhs.size()));
+			return VectorXd(scale * correction.cast<double>());
+		};
+
+		// J * dx = -res, iterative refinement with the linear residual in double
+		const VectorXd derivative = double(step_size) * 4.0 * x.array().cube();
+		dx = solveLinear(-res);
+		for (unsigned int r = 0; r < refinement_steps; r++)
+		{
+			freeOperator.apply(VectorXd(derivative.cwiseProduct(dx)), tmp);
+			lin_res = -res - tmp;
+			if (!compute_steady_state)
+				lin_res += dx;
+			if (lin_res.norm() <= refinement_tol * res.norm())
+				break;
+			dx += solveLinear(lin_res);
+		}
+		solve_iterations++;
+
+		// line search, bounded
+		double alpha = 1.0;
+		double res_norm = res.squaredNorm();
+		double x_alpha_norm = 0.0;
+		for (unsigned int ls = 0; ; ls++)
+		{
+			x_alpha = x + alpha * dx;
+			evaluateResidual(x_alpha, current, res_alpha);
+			x_alpha_norm = res_alpha.squaredNorm();
+			if (x_alpha_norm <= res_norm || std::isnan(x_alpha_norm))
+				break;
+			if (ls + 1 >= max_line_search)
+			{
+				spdlog::warn("ThermalSolver - line search limit reached (alpha: {})", alpha);
+				break;
+			}
+			alpha *= 0.5;
+		}
+		x.swap(x_alpha);
+		res.swap(res_alpha);
+
+		res_norm = x_alpha_norm;
+		double dx_norm = (x - prev_x).squaredNorm();
+		double dres_norm = (res - prev_res).squaredNorm();
+		prev_x = x;
+		prev_res = res;
+
+		if (std::isnan(res_norm))
+		{
+			spdlog::error("ThermalSolver - value norm is NaN");
+			break;
+		}
+
+		spdlog::info("ThermalSolver - mixed iter: {}/{}, res_norm: {}, dres_norm: {} <> {} (f_tol), dx_norm: {} <> {} (x_tol), alpha: {}", i, max_iter, res_norm, dres_norm, f_tol, dx_norm, x_tol, alpha);
+
+		if (dres_norm < f_tol && dx_norm < x_tol)
+			break;
+	}
+	_x = x.cast<SCALAR>();
+}
+
+void ThermalSolver::extrapolateSteadyState(Vec& x)
+{
+	if (!steadyHistory.empty() && steadyHistory.back().size() != x.size())
+		steadyHistory.clear();
+	if (steadyHistory.empty())
+		return;
+
+	// polynomial extrapolation over the last solutions (constant, linear, quadratic)
+	const int n = steadyHistory.size();
+	const Vec& x0 = steadyHistory[n - 1];
+	Vec guess = x0;
+	if (n == 2)
+		guess = 2.0 * x0 - steadyHistory[n - 2];
+	else if (n >= 3)
+		guess = 3.0 * x0 - 3.0 * steadyHistory[n - 2] + steadyHistory[n - 3];
+
+	// extrapolation must not leave the physical range
+	x = (guess.array() > 0.0).select(guess, x0);
+}
+
+Vec ThermalSolver::fixedPointMap(const Vec& x)
+{
+	// one Jacobi sweep of T_ff * x^4 = -T_f,fixed * x_fixed^4 in x^4, needs only a matvec
+	Vec x4 = x.array().pow(4.0).matrix();
+	Vec tx4;
+	freeOperator.apply(x4, tx4);
+	Vec z = x4 + steadyInvDiagonal.cwiseProduct(tx4 + fixedRhs);
+	return z.cwiseMax(0.0).array().pow(0.25).matrix();
+}
+
+void ThermalSolver::solveAnderson(Vec& x)
+{
+	const int vsize = x.size();
+	Vec diagonal = freeMatrix.diagonal();
+	steadyInvDiagonal = (diagonal.array() < 0.0).select(-diagonal.cwiseInverse(), Vec::Zero(vsize));
+
+	const int depth = std::max(1u, anderson_depth);
+	Mat dF(vsize, 0);	// differences of the fixed point residuals f = g(x) - x
+	Mat dG(vsize, 0);	// differences of g(x)
+	Vec g_prev, f_prev;
+	krylov_iterations = 0;
+	solve_iterations = 0;
+
+	SCALAR f_norm = 0.0;
+	for (int i = 0; i < max_iter; i++)
+	{
+		Vec g = fixedPointMap(x);
+		Vec f = g - x;
+		solve_iterations++;
+
+		f_norm = f.cwiseAbs().maxCoeff();
+		if (isnan(f_norm))
+		{
+			spdlog::error("ThermalSolver - Anderson residual is NaN");
+			break;
+		}
+		if (f_norm < anderson_tol * std::max<SCALAR>(x.cwiseAbs().maxCoeff(), 1e-12))
+		{
+			x = g;
+			break;
+		}
+
+		if (i > 0)
+		{
+			if (dF.cols() == depth)
+			{
+				dF.leftCols(depth - 1) = dF.rightCols(depth - 1).eval();
+				dG.leftCols(depth - 1) = dG.rightCols(depth - 1).eval();
+			}
+			else
+			{
+				dF.conservativeResize(NoChange, dF.cols() + 1);
+				dG.conservativeResize(NoChange, dG.cols() + 1);
+			}
+			dF.col(dF.cols() - 1) = f - f_prev;
+			dG.col(dG.cols() - 1) = g - g_prev;
+		}
+		g_prev = g;
+		f_prev = f;
+
+		if (dF.cols() == 0)
+		{
+			x = g;
+			continue;
+		}
+
+		// x = g - dG * gamma with gamma = argmin |f - dF * gamma|
+		Vec gamma = dF.colPivHouseholderQr().solve(f);
+		Vec next = g - dG * gamma;
+		// fall back to the plain fixed point step if acceleration leaves the physical range
+		x = (next.array() > 0.0).select(next, g);
+	}
+	spdlog::info("ThermalSolver - Anderson iter: {}/{}, max |g(x) - x|: {}", solve_iterations, max_iter, f_norm);
+}
+
+void ThermalSolver::solveBatch(ColMat& _X, const ColMat& _currentKelvin, const SpMat& _transportMatrix, const Vec& _fixedVars)
+{
+	const int conditions = _X.cols();
+
+	if (mode == 1)
+	{
+		_X = _transportMatrix * _X;
+		return;
+	}
+
+	preparePartition(_transportMatrix, _fixedVars);
+
+	// reduce to free variables, fixed ones become one right-hand side per condition
+	const int vsize = freeIndices.size();
+	ColMat X(vsize, conditions);
+	ColMat current(vsize, conditions);
+	ColMat fixed(fixedIndices.size(), conditions);
+	for (int k = 0; k < vsize; k++)
+	{
+		X.row(k) = _X.row(freeIndices[k]);
+		current.row(k) = _currentKelvin.row(freeIndices[k]);
+	}
+	for (int k = 0; k < (int)fixedIndices.size(); k++)
+		fixed.row(k) = _currentKelvin.row(fixedIndices[k]);
+	const ColMat fixed_rhs = couplingMatrix * fixed.array().pow(4.0).matrix();
+
+	auto residuals = [&](const ColMat& _x) {
+		ColMat tx4;
+		freeOperator.apply(_x.array().pow(4.0).matrix(), tx4);
+		ColMat r = step_size * (tx4 + fixed_rhs);
+		if (!compute_steady_state)
+			r += current - _x;
+		return r;
+	};
+
+	// one preconditioner for all conditions, built at the first condition
+	if (conditions > 0)
+		preparePreconditioner(X.col(0));
+	const ThermalPreconditioner* active_precond = precond.built ? &precond : nullptr;
+
+	ColMat R = residuals(X);
+	ColMat prev_X = X;
+	ColMat prev_R = R;
+	ColMat dX(vsize, conditions);
+	std::vector<bool> active(conditions, true);
+
+	for (int i = 0; i < max_iter; i++)
+	{
+		// the Jacobian differs per condition, the linear solves run in parallel
+#pragma omp parallel for schedule(dynamic)
+		for (int c = 0; c < conditions; c++)
+		{
+			if (!active[c])
+			{
+				dX.col(c).setZero();
+				continue;
+			}
+			Vec x = X.col(c);
+			Vec r = R.col(c);
+			if (matrix_free)
+			{
+				JacobianOperator op;
+				op.transport = &freeOperator;
+				op.parallel = false;
+				op.derivative = step_size * 4.0 * x.array().pow(3.0);
+				op.subtractIdentity = !compute_steady_state;
+				BiCGSTAB<JacobianOperator, ReusedPreconditioner> bicg;
+				bicg.preconditioner().source = active_precond;
+				bicg.compute(op);
+				dX.col(c) = -bicg.solve(r);
+			}
+			else
+			{
+				SpMat J = freeMatrix * (step_size * 4.0 * x.array().pow(3.0)).matrix().asDiagonal();
+				if (!compute_steady_state)
+				{
+					SpMat identity(vsize, vsize);
+					identity.setIdentity();
+					J -= identity;
+				}
+				J.makeCompressed();
+				BiCGSTAB<SpMat, ReusedPreconditioner> bicg;
+				bicg.preconditioner().source = active_precond;
+				bicg.compute(J);
+				dX.col(c) = -bicg.solve(r);
+			}
+		}
+
+		// line search per condition, all trial residuals evaluated as one product
+		Vec alpha = Vec::Ones(conditions);
+		Vec res_norm = R.colwise().squaredNorm().transpose();
+		ColMat X_alpha = X + dX;
+		ColMat R_alpha = residuals(X_alpha);
+		for (unsigned int ls = 0;; ls++)
+		{
+			std::vector<bool> rejected(conditions, false);
+			bool reduce = false;
+			for (int c = 0; c < conditions; c++)
+			{
+				rejected[c] = active[c] && res_norm[c] < R_alpha.col(c).squaredNorm();
+				reduce = reduce || rejected[c];
+			}
+			if (!reduce)
+				break;
+			if (ls + 1 >= max_line_search)
+			{
+				spdlog::warn("ThermalSolver - line search limit reached (alpha: {})", alpha.minCoeff());
+				break;
+			}
+			for (int c = 0; c < conditions; c++)
+			{
+				if (rejected[c])
+				{
+					alpha[c] *= 0.5;
+					X_alpha.col(c) = X.col(c) + alpha[c] * dX.col(c);
+				}
+			}
+			R_alpha = residuals(X_alpha);
+		}
+
+		X = X_alpha;
+		R = R_alpha;
+
+		int active_count = 0;
+		for (int c = 0; c < conditions; c++)
+		{
+			if (!active[c])
+				continue;
+			SCALAR dx_norm = (X.col(c) - prev_X.col(c)).squaredNorm();
+			SCALAR dres_norm = (R.col(c) - prev_R.col(c)).squaredNorm();
+			if (isnan(R.col(c).squaredNorm()))
+			{
+				spdlog::error("ThermalSolver - value norm is NaN (condition {})", c);
+				active[c] = false;
+			}
+			else if (dres_norm < f_tol && dx_norm < x_tol)
+				active[c] = false;
+			else
+				active_count++;
+		}
+		prev_X = X;
+		prev_R = R;
+
+		spdlog::info("ThermalSolver - batch iter: {}/{}, active conditions: {}/{}", i, max_iter, active_count, conditions);
+		if (active_count == 0)
+			break;
+	}
+
+	for (int k = 0; k < vsize; k++)
+		_X.row(freeIndices[k]) = X.row(k);
+	for (int k = 0; k < (int)fixedIndices.size(); k++)
+		_X.row(fixedIndices[k]) = fixed.row(k);
+}
+
+SCALAR ThermalSolver::adaptiveStep(Vec& x, SCALAR _max_step, const SpMat& _transportMatrix, const Vec& _fixedVars)
+{
+	const bool steady_state = compute_steady_state;
+	const SCALAR step = step_size;
+	compute_steady_state = false;
+
+	SCALAR taken = 0;
+	while (true)
+	{
+		SCALAR h = std::min({ adaptive_step, adaptive_max_step, _max_step });
+
+		// one full step against two half steps, the difference estimates the local error
+		step_size = h;
+		Vec full = x;
+		solve(full, x, _transportMatrix, _fixedVars);
+		step_size = 0.5 * h;
+		Vec half = x;
+		solve(half, x, _transportMatrix, _fixedVars);
+		Vec two_halves = half;
+		solve(two_halves, half, _transportMatrix, _fixedVars);
+
+		SCALAR error = ((two_halves - full).array().abs() / (adaptive_atol + adaptive_rtol * two_halves.array().abs())).maxCoeff();
+		// local error of backward Euler is O(h^2)
+		SCALAR factor = error > 0 ? SCALAR(0.9) / std::sqrt(error) : SCALAR(4.0);
+		factor = std::clamp<SCALAR>(factor, 0.2, 4.0);
+
+		if (error <= 1.0 || h <= adaptive_min_step)
+		{
+			x = two_halves;
+			taken = h;
+			// a step cut short by _max_step says nothing about the achievable step size
+			if (h == adaptive_step || factor < 1.0)
+				adaptive_step = std::max(adaptive_min_step, h * factor);
+			break;
+		}
+
+		adaptive_rejected++;
+		adaptive_step = std::max(adaptive_min_step, h * factor);
+		spdlog::info("ThermalSolver - rejected step {:.3} h (error: {:.3}), retry with {:.3} h", h / (3600.0 * secondsUnitFactor), error, adaptive_step / (3600.0 * secondsUnitFactor));
+	}
+
+	compute_steady_state = steady_state;
+	step_size = step;
+	return taken;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "thermal_common.hpp"
+#include "thermal_operator.hpp"
 
 #include "../../../assets/shader/raytracing_thermal/defines.h"
 
@@ -17,32 +18,266 @@
 
 using namespace Eigen;
 
+class JacobianOperator;
+
+namespace Eigen {
+	namespace internal {
+		// the operator behaves like a sparse matrix when used with the iterative solvers
+		template<> struct traits<JacobianOperator> : public Eigen::internal::traits<Eigen::SparseMatrix<SCALAR>> {};
+	}
+}
+
+// matrix-free Jacobian of the reduced residual: J*v = step_size * T_ff * (4x^3 .* v) (- v for time steps)
+class JacobianOperator : public EigenBase<JacobianOperator> {
+
+public:
+
+	typedef SCALAR Scalar;
+	typedef SCALAR RealScalar;
+	typedef int StorageIndex;
+	enum {
+		ColsAtCompileTime = Eigen::Dynamic,
+		MaxColsAtCompileTime = Eigen::Dynamic,
+		IsRowMajor = false
+	};
+
+	Index rows() const { return transport->rows(); }
+	Index cols() const { return transport->cols(); }
+
+	template<typename Rhs>
+	Product<JacobianOperator, Rhs, AliasFreeProduct> operator*(const MatrixBase<Rhs>& x) const {
+		return Product<JacobianOperator, Rhs, AliasFreeProduct>(*this, x.derived());
+	}
+
+	void apply(const Vec& v, Vec& out) const;
+
+	const TransportOperator* transport = nullptr;
+	Vec derivative;			// step_size * 4x^3
+	bool subtractIdentity = false;
+	bool parallel = true;	// false when called from worker threads
+};
+
+namespace Eigen {
+	namespace internal {
+		template<typename Rhs>
+		struct generic_product_impl<JacobianOperator, Rhs, SparseShape, DenseShape, GemvProduct>
+			: generic_product_impl_base<JacobianOperator, Rhs, generic_product_impl<JacobianOperator, Rhs> >
+		{
+			typedef typename Product<JacobianOperator, Rhs>::Scalar Scalar;
+
+			template<typename Dest>
+			static void scaleAndAddTo(Dest& dst, const JacobianOperator& lhs, const Rhs& rhs, const Scalar& alpha)
+			{
+				Vec out;
+				lhs.apply(rhs, out);
+				dst.noalias() += alpha * out;
+			}
+		};
+	}
+}
+
+// preconditioner built from an assembled Jacobian, kept across Newton iterations and time steps until rebuilt
+class ThermalPreconditioner {
+
+public:
+
+	enum Type { NONE = 0, JACOBI = 1, BLOCK_JACOBI = 2, ILUT = 3, MULTIGRID = 4 };
+
+	// one coarsening step, fine variables are merged into spatial clusters per object
+	typedef struct Aggregation_s {
+		std::vector<int> aggregate;	// coarse index per fine variable
+		Vec fineArea;
+		Vec coarseArea;
+	} Aggregation_s;
+
+	void build(Type _type, const SpMat& _jacobian, const std::vector<int>& _blocks);
+	void buildJacobi(const Vec& _diagonal);
+	Vec apply(const Vec& b) const;
+	void clear() { built = false; }
+
+	bool built = false;
+	Type type = NONE;
+
+	SCALAR sparsifyTolerance = 1e-6;	// off diagonal entries below this (relative to the row diagonal) are dropped before ILUT
+	SCALAR dropTolerance = 1e-4;		// ILUT drop tolerance
+	int fillFactor = 10;				// ILUT fill factor
+
+	std::vector<Aggregation_s> hierarchy;	// MULTIGRID levels, geometry dependent and set with the partition
+	SCALAR smootherDamping = 0.7;			// damped Jacobi smoothing per level
+	int smootherSteps = 2;					// pre- and post-smoothing steps
+
+private:
+
+	Vec vcycle(size_t _level, const Vec& b) const;
+
+	// MULTIGRID operators per level, restriction averages weighted by area, prolongation is piecewise constant
+	std::vector<SpMat> levelMatrix;
+	std::vector<Vec> levelInvDiagonal;
+	std::vector<SpMat> restriction;
+	std::vector<SpMat> prolongation;
+	SparseLU<SparseMatrix<SCALAR>> coarseLU;
+
+	Vec invDiagonal;
+	SparseLU<SparseMatrix<SCALAR>> blockLU;
+	IncompleteLUT<SCALAR> ilut;
+};
+
+// adapter for Eigen's iterative solvers, compute() leaves the prebuilt preconditioner untouched
+class ReusedPreconditioner {
+
+public:
+
+	typedef SCALAR Scalar;
+
+	ReusedPreconditioner() {}
+	template<typename MatType> explicit ReusedPreconditioner(const MatType&) {}
+	template<typename MatType> ReusedPreconditioner& analyzePattern(const MatType&) { return *this; }
+	template<typename MatType> ReusedPreconditioner& factorize(const MatType&) { return *this; }
+	template<typename MatType> ReusedPreconditioner& compute(const MatType&) { return *this; }
+	template<typename Rhs> Vec solve(const Rhs& b) const { return source ? source->apply(b) : Vec(b); }
+	ComputationInfo info() { return Success; }
+
+	const ThermalPreconditioner* source = nullptr;
+};
+
 class ThermalSolver {
 
 public:
 
-	Vec ThermalSolver::residual(const Vec& x, const Vec& _currentKelvin, const Mat& _transportMatrix, const Vec& _fixedVars);
-	void ThermalSolver::jacobian(const Vec& x, Mat& jac, const Mat& _transportMatrix, const Vec& _fixedVars);
-	void ThermalSolver::solve(Vec& x, const Vec& _currentKelvin, const Mat& _transportMatrix, const Vec& _fixedVars);
+	// the Newton system only covers free variables, fixed ones enter through a precomputed right-hand side
+	void partition(const SpMat& _transportMatrix, const Vec& _fixedVars);
+	void updateFixedValues(const Vec& _currentKelvin);
+
+	Vec residual(const Vec& x, const Vec& _currentKelvin);
+	void jacobian(const Vec& x, SpMat& jac);
+	void jacobianOperator(const Vec& x, JacobianOperator& op);
+	void solve(Vec& x, const Vec& _currentKelvin, const SpMat& _transportMatrix, const Vec& _fixedVars);
+	// independent conditions (e.g. sky values per hour) solved together, T * X^4 is evaluated as one sparse-dense product
+	void solveBatch(ColMat& X, const ColMat& _currentKelvin, const SpMat& _transportMatrix, const Vec& _fixedVars);
+	// one accepted backward Euler step of at most _max_step, size controlled by step doubling; returns the step taken
+	SCALAR adaptiveStep(Vec& x, SCALAR _max_step, const SpMat& _transportMatrix, const Vec& _fixedVars);
+	// x = exp(step_size * A) * x with A = T and the rows of fixed variables cleared (mode 1 time stepping)
+	void applyExponential(Vec& x, const SpMat& _transportMatrix, const Vec& _fixedVars);
 	void reset();
+	void preparePartition(const SpMat& _transportMatrix, const Vec& _fixedVars);
+	void setTransportPrecision(TransportPrecision _precision);
+	TransportPrecision getTransportPrecision() const { return transport_precision; }
+	SCALAR getTransportStorageError() const { return freeOperator.getStorageError(); }
+	const std::vector<int>& getFreeIndices() const { return freeIndices; }
+	const std::vector<int>& getFixedIndices() const { return fixedIndices; }
+	const SpMat& getFreeMatrix() const { return freeMatrix; }
+	const SpMat& getCouplingMatrix() const { return couplingMatrix; }
+	void setBlocks(const std::vector<unsigned int>& _vertexOffset, const std::vector<unsigned int>& _vertexCount);
+	// vertex positions and areas for the multigrid coarsening
+	void setGeometry(const Mat& _positions, const Vec& _areas);
+	// coarsest multigrid level size and damped Jacobi steps per level, the hierarchy is rebuilt
+	void setMultigrid(unsigned int _coarse_size, unsigned int _smoother_steps);
 
 	SCALAR step_size = 1000.0 * secondsUnitFactor;
 	bool compute_steady_state = true;
 	int mode = 0;
+	bool matrix_free = true; // apply the Jacobian as operator instead of assembling it
+	bool reorder_free = true; // reverse Cuthill-McKee order of the free variables (matvec locality, narrower ILUT fill)
+	unsigned int multigrid_coarse_size = 1000;	// coarsening stops below, the coarsest level is factorized
+	SCALAR multigrid_cluster_size = 8.0;		// target fine vertices per cluster
+	ThermalPreconditioner::Type preconditioner = ThermalPreconditioner::JACOBI;
+	bool rebuild_preconditioner = true; // per solve (time step), otherwise once per scene until reset()
+	unsigned int krylov_iterations = 0; // of the last solve
+	unsigned int solve_iterations = 0;	// Newton or fixed point iterations of the last solve
+	float solve_seconds = 0.0;			// duration of the last solve
+
+	// steady state: start from an extrapolation of the last solutions (e.g. consecutive hours)
+	bool warm_start = true;
+	unsigned int warm_start_history = 3;
+	// steady state: Anderson-accelerated fixed point (Jacobi in x^4) instead of Newton, only needs matvecs with T
+	bool anderson_acceleration = false;
+	unsigned int anderson_depth = 5;
+	SCALAR anderson_tol = 1e-6;	// relative max norm of g(x) - x
+	// Newton with double iterate and residuals, float matrix, matvecs and Krylov solves, corrections refined in double
+	bool mixed_precision = false;
+	unsigned int refinement_steps = 3;
+	double refinement_tol = 1e-10;	// relative linear residual |J*dx + res| / |res| that ends the refinement
+
+	// exponential integrator for mode 1, dense exponential for small systems, Krylov (Arnoldi) otherwise
+	bool exponential_integrator = false;
+	unsigned int dense_exponential_limit = 2048;
+	unsigned int krylov_dimension = 30;
+	SCALAR krylov_tolerance = 1e-6;
+
+	// adaptive time stepping
+	SCALAR adaptive_step = 600.0 * secondsUnitFactor;	// current step size, carried over between calls
+	SCALAR adaptive_min_step = 1.0 * secondsUnitFactor;
+	SCALAR adaptive_max_step = 3.0 * 3600.0 * secondsUnitFactor;
+	SCALAR adaptive_rtol = 1e-3;
+	SCALAR adaptive_atol = 0.01 * kelvinUnitFactor;
+	unsigned int adaptive_rejected = 0;
 
 private:
 
-	Mat jac;
-	Vec dx;
-	Vec res;
-	Vec x_alpha_res;
-	Vec prev_x;
-	Vec prev_res;
+	void preparePreconditioner(const Vec& x);
+	void solveNewton(Vec& x, const Vec& current);
+	void evaluateResidual(const Vec& x, const Vec& _current, Vec& x4, Vec& tx4, Vec& out);
+	void evaluateResidual(const VectorXd& x, const VectorXd& _current, VectorXd& out);
+	void solveNewtonMixed(Vec& x, const Vec& current);
+	void solveAnderson(Vec& x);
+	Vec fixedPointMap(const Vec& x);
+	void extrapolateSteadyState(Vec& x);
+
+	std::vector<Vec> steadyHistory;	// last steady state solutions (free variables)
+	Vec steadyInvDiagonal;			// -1 / diag(T_ff)
+	void krylovExpmv(Vec& x, SCALAR _t);
+
+	// exponential integrator, reused between steps of equal size until reset()
+	SpMat expOperator;
+	SparseMatrix<double, RowMajor> expOperatorDouble;	// double copy for the Arnoldi products and the dense exponential
+	bool expOperatorValid = false;
+	Mat denseExponential;
+	SCALAR denseExponentialStep = -1;
+	SCALAR krylovStep = -1;				// last accepted Krylov substep, start value for the next step
+	MatrixXd krylovBasis;
+	MatrixXd krylovHessenberg;
+
+	// partitioned system
+	bool partitioned = false;
+	std::vector<int> vertexBlocks;	// object index per vertex
+	std::vector<int> freeBlocks;	// object index per free variable
+	Mat vertexPositions;
+	Vec vertexAreas;
+	void buildHierarchy();
+	ThermalPreconditioner precond;
+	std::vector<int> freeIndices;
+	std::vector<int> fixedIndices;
+	SpMat freeMatrix;		// T_ff
+	TransportOperator freeOperator;
+	TransportPrecision transport_precision = TransportPrecision::FP32; // value storage used by the T_ff products
+	SpMat couplingMatrix;	// T_f,fixed
+	Vec fixedValues;		// x_fixed the right-hand side was computed for
+	Vec fixedRhs;			// T_f,fixed * x_fixed^4
+	VectorXd fixedRhsDouble;
+
+	SpMat jac;
+	JacobianOperator jac_op;
+	// preallocated temporaries of the Newton iteration, reallocated only when the system size changes
+	struct SolverWorkspace {
+		void resize(int _size);
+		Vec dx;
+		Vec res;
+		Vec prev_x;
+		Vec prev_res;
+		Vec x4;			// x^4 of the current iterate
+		Vec tx4;		// T_ff * x^4 of the current iterate
+		Vec x_alpha;	// line search candidate
+		Vec x_alpha4;
+		Vec tx_alpha4;
+		Vec res_alpha;
+	} workspace;
 
 	SCALAR f_tol = 1e-08;
 	SCALAR x_tol = 1e-06;
 	SCALAR a_tol = 1e-06;
 	unsigned int max_iter = 1000;
+	unsigned int max_line_search = 20;
 
-	BiCGSTAB<Mat> solver;	
+	BiCGSTAB<SpMat, ReusedPreconditioner> solver;
+	BiCGSTAB<JacobianOperator, ReusedPreconditioner> mf_solver;
 };
\ No newline at end of file
@@ -6,6 +6,9 @@
 #include <iostream>
 #include<chrono>
 #include <sstream>
+#include <algorithm>
+#include <limits>
+#include <numeric>
 
 void ThermalTransport::prepare(rvk::Buffer& geometryDataBuffer, GeometryDataBlasVulkan& _gpuBlas)
 {
@@ -22,6 +25,8 @@ void ThermalTransport::prepare(rvk::Buffer& geometryDataBuffer, GeometryDataBlas
 	globalDescriptor.addStorageBuffer(GLSL_GLOBAL_EMISSION_DATA_BINDING, rvk::Shader::Stage::RAYGEN);
 	globalDescriptor.addStorageBuffer(GLSL_GLOBAL_ABSORPTION_DATA_BINDING, rvk::Shader::Stage::RAYGEN);
 	globalDescriptor.addStorageBuffer(GLSL_GLOBAL_OUT_IMAGE_BINDING, rvk::Shader::Stage::RAYGEN);
+	globalDescriptor.addStorageBuffer(GLSL_GLOBAL_TRIANGLE_DATA_BINDING, rvk::Shader::Stage::RAYGEN);
+	globalDescriptor.addStorageBuffer(GLSL_GLOBAL_TRIANGLE_RAY_DATA_BINDING, rvk::Shader::Stage::RAYGEN);
 	// set
 	globalDescriptor.setBuffer(GLSL_GLOBAL_GEOMETRY_DATA_BINDING, &geometryDataBuffer);
 	globalDescriptor.setBuffer(GLSL_GLOBAL_INDEX_BUFFER_BINDING, _gpuBlas.getIndexBuffer());
@@ -39,7 +44,9 @@ void ThermalTransport::prepare(rvk::Buffer& geometryDataBuffer, GeometryDataBlas
 
 	rt_transport_pipeline.setShader(&rt_transport_shader);
 	rt_transport_pipeline.addDescriptorSet({ &globalDescriptor });
+	rt_transport_pipeline.addPushConstant(rvk::Shader::Stage::RAYGEN, 0, sizeof(TransportPushConstants));
 	rt_transport_pipeline.finish();
+	rtPipeline = true;
 }
 
 void ThermalTransport::initAS(
@@ -79,11 +86,26 @@ void ThermalTransport::initAS(
 	int vertex_count = 0;
 	int triangle_count = 0;
 
-	for (RefModel_s* refModel : _scene.refModels) {
+	// per triangle vertex indices and instance, replaces the linear geometry scan in the ray generation shader
+	std::vector<TriangleSSBO> triangles;
+	triangles.reserve(_thermalScene.getProperties().triangleCount);
+
+	for (unsigned int instance_index = 0; instance_index < _scene.refModels.size(); instance_index++) {
+		RefModel_s* refModel = _scene.refModels[instance_index];
 		// each mesh in our model will be a geometry of this models blas
 		for (RefMesh_s* refMesh : refModel->refMeshes) {
 			Mesh* m = refMesh->mesh;
 			GeometryDataVulkan::primitveBufferOffset_s offsets = _gpuBlas.getOffset(m);
+			if (m->hasIndices()) {
+				const std::vector<uint32_t>& indices = *m->getIndicesVector();
+				for (size_t k = 0; k + 2 < indices.size(); k += 3)
+					triangles.push_back({ offsets.mVertexOffset + indices[k], offsets.mVertexOffset + indices[k + 1], offsets.mVertexOffset + indices[k + 2], instance_index });
+			}
+			else {
+				for (unsigned int k = 0; k + 2 < m->getVertexCount(); k += 3)
+					triangles.push_back({ offsets.mVertexOffset + k, offsets.mVertexOffset + k + 1, offsets.mVertexOffset + k + 2, instance_index });
+			}
+
 			// add geometry infos to our geometry lookup buffer
 			geometry[geometry_count].index_buffer_offset = offsets.mIndexOffset;
 			geometry[geometry_count].vertex_buffer_offset = offsets.mVertexOffset;
@@ -93,6 +115,7 @@ void ThermalTransport::initAS(
 			if (refMesh->mesh->getMaterial()->hasBaseColorTexture()) geometry[geometry_count].baseColorTexIdx = refMesh->mesh->getMaterial()->getBaseColorTexture()->index;
 			geometry[geometry_count].alphaCutoff = refMesh->mesh->getMaterial()->getAlphaDiscardValue();
 			geometry[geometry_count].triangleCount = m->getVertexCount() / 3;
+			geometry[geometry_count].triangleOffset = triangle_count;
 
 			// index
 			if (m->hasIndices()) {
@@ -109,6 +132,8 @@ void ThermalTransport::initAS(
 		}
 	}
 	geometryDataBuffer.STC_UploadData(&_stc, &geometry, geometry_count * sizeof(GeometrySSBO));
+	if (!triangles.empty())
+		triangleBuffer.STC_UploadData(&_stc, triangles.data(), triangles.size() * sizeof(TriangleSSBO));
 
 	// add the tlas to the descriptor and update it
 	globalDescriptor.setAccelerationStructureKHR(GLSL_GLOBAL_AS_BINDING, &top);
@@ -117,34 +142,87 @@ void ThermalTransport::initAS(
 	_thermalScene.getProperties().triangleCount = triangle_count;
 }
 
-void ThermalTransport::setupBuffers(unsigned int _vertex_count, unsigned int _triangle_count)
+void ThermalTransport::setupBuffers(rvk::LogicalDevice* _device, unsigned int _vertex_count, unsigned int _triangle_count)
+{
+	int vertex_slice_size = glm::max((unsigned int)1, 2 * _vertex_count);
+
+	// create, only the displayed transport slice and values, the ray tracing buffers follow on the first gpu traced estimate
+	transportBuffer.create(rvk::Buffer::Use::STORAGE, vertex_slice_size * sizeof(FLOAT), rvk::Buffer::Location::DEVICE);
+	valueBuffer.create(rvk::Buffer::Use::STORAGE, _vertex_count * sizeof(FLOAT), rvk::Buffer::Location::DEVICE);
+	rtBuffers = false;
+}
+
+bool ThermalTransport::planRecordCapacity(rvk::LogicalDevice* _device, unsigned int _vertex_count, unsigned int _triangle_count)
 {
-	int vertex_matrix_size = glm::max((unsigned int)1, _vertex_count * _vertex_count);
+	// the record buffer is device local, its two readback copies are host coherent (the same heap on integrated gpus)
+	const VkDeviceSize scene_size = (VkDeviceSize)_vertex_count * 2 * sizeof(FLOAT) + VK_TRANSPORT_RECORD_HEADER_SIZE
+		+ (VkDeviceSize)glm::max(1u, _triangle_count) * (sizeof(FLOAT) + sizeof(TriangleSSBO) + sizeof(TriangleRaysSSBO));
+	const VkDeviceSize readback_size = 2 * (VK_TRANSPORT_SEGMENT_BATCHES * sizeof(uint32_t) + VK_TRANSPORT_RECORD_HEADER_SIZE);
+	const VkDeviceSize device_available = getDeviceLocalBudget(_device);
+	bool shared_heap = false;
+	const VkDeviceSize host_available = getHostCoherentBudget(_device, shared_heap);
+
+	VkDeviceSize records = 0;
+	if (shared_heap)
+	{
+		if (device_available > scene_size + readback_size)
+			records = VkDeviceSize((device_available - scene_size - readback_size) * recordBudgetFraction) / (3 * sizeof(TransportRecord));
+	}
+	else if (device_available > scene_size && host_available > readback_size)
+	{
+		records = glm::min(VkDeviceSize((device_available - scene_size) * recordBudgetFraction) / sizeof(TransportRecord),
+			VkDeviceSize((host_available - readback_size) * recordBudgetFraction) / (2 * sizeof(TransportRecord)));
+	}
+	records = glm::min(records, (VkDeviceSize)(VK_TRANSPORT_RECORD_COUNT));
+
+	if (records < VK_TRANSPORT_MIN_RECORD_COUNT)
+	{
+		spdlog::error("ThermalTransport: scene buffers ({:.3} MB) leave no room for the transport records (device budget {:.3} MB, host coherent budget {:.3} MB)",
+			scene_size / (1024.0 * 1024.0), device_available / (1024.0 * 1024.0), host_available / (1024.0 * 1024.0));
+		return false;
+	}
+	recordCapacity = (unsigned int)records;
+	spdlog::info("ThermalTransport: record buffer capacity {} ({:.3} MB device, {:.3} MB host coherent readback, device budget {:.3} MB)", recordCapacity,
+		recordCapacity * sizeof(TransportRecord) / (1024.0 * 1024.0), 2 * recordCapacity * sizeof(TransportRecord) / (1024.0 * 1024.0), device_available / (1024.0 * 1024.0));
+	return true;
+}
 
+void ThermalTransport::setupRayTracingBuffers(rvk::LogicalDevice* _device, unsigned int _vertex_count, unsigned int _triangle_count)
+{
 	// create
 	instanceDataBuffer.create(rvk::Buffer::Use::STORAGE, VK_INSTANCE_SIZE * sizeof(InstanceSSBO), rvk::Buffer::Location::HOST_COHERENT);
-	transportBuffer.create(rvk::Buffer::Use::STORAGE, vertex_matrix_size * sizeof(FLOAT), rvk::Buffer::Location::DEVICE);
+	transportRecordBuffer.create(rvk::Buffer::Use::STORAGE, VK_TRANSPORT_RECORD_HEADER_SIZE + (VkDeviceSize)recordCapacity * sizeof(TransportRecord), rvk::Buffer::Location::DEVICE);
+	for (rvk::Buffer& readback : recordReadbackBuffers)
+		readback.create(rvk::Buffer::Use::UPLOAD, VK_TRANSPORT_SEGMENT_BATCHES * sizeof(uint32_t) + VK_TRANSPORT_RECORD_HEADER_SIZE + (VkDeviceSize)recordCapacity * sizeof(TransportRecord), rvk::Buffer::Location::HOST_COHERENT);
 	globalUniformBuffer.create(rvk::Buffer::Use::UNIFORM, sizeof(AuxiliaryUbo), rvk::Buffer::Location::DEVICE);
-	triangleAreaBuffer.create(rvk::Buffer::Use::STORAGE, _triangle_count * sizeof(FLOAT), rvk::Buffer::Location::DEVICE);
+	triangleAreaBuffer.create(rvk::Buffer::Use::STORAGE, glm::max((unsigned int)1, _triangle_count) * sizeof(FLOAT), rvk::Buffer::Location::DEVICE);
+	triangleBuffer.create(rvk::Buffer::Use::STORAGE, glm::max((unsigned int)1, _triangle_count) * sizeof(TriangleSSBO), rvk::Buffer::Location::DEVICE);
+	triangleRayBuffer.create(rvk::Buffer::Use::STORAGE, glm::max((unsigned int)1, _triangle_count) * sizeof(TriangleRaysSSBO), rvk::Buffer::Location::DEVICE);
 	vertexEmissionBuffer.create(rvk::Buffer::Use::STORAGE, _vertex_count * sizeof(FLOAT), rvk::Buffer::Location::DEVICE);
 	vertexAbsorptionBuffer.create(rvk::Buffer::Use::STORAGE, _vertex_count * sizeof(FLOAT), rvk::Buffer::Location::DEVICE);
-	valueBuffer.create(rvk::Buffer::Use::STORAGE, _vertex_count * sizeof(FLOAT), rvk::Buffer::Location::DEVICE);
 
 	// map
 	instanceDataBuffer.mapBuffer();
+	for (rvk::Buffer& readback : recordReadbackBuffers)
+		readback.mapBuffer();
 
 	// set
 	globalDescriptor.setBuffer(GLSL_GLOBAL_INSTANCE_DATA_BINDING, &instanceDataBuffer);
-	globalDescriptor.setBuffer(GLSL_GLOBAL_OUT_IMAGE_BINDING, &transportBuffer);
+	globalDescriptor.setBuffer(GLSL_GLOBAL_OUT_IMAGE_BINDING, &transportRecordBuffer);
 	globalDescriptor.setBuffer(GLSL_GLOBAL_UBO_BINDING, &globalUniformBuffer);
 	globalDescriptor.setBuffer(GLSL_GLOBAL_AREA_DATA_BINDING, &triangleAreaBuffer);
+	globalDescriptor.setBuffer(GLSL_GLOBAL_TRIANGLE_DATA_BINDING, &triangleBuffer);
+	globalDescriptor.setBuffer(GLSL_GLOBAL_TRIANGLE_RAY_DATA_BINDING, &triangleRayBuffer);
 	globalDescriptor.setBuffer(GLSL_GLOBAL_EMISSION_DATA_BINDING, &vertexEmissionBuffer);
 	globalDescriptor.setBuffer(GLSL_GLOBAL_ABSORPTION_DATA_BINDING, &vertexAbsorptionBuffer);
+	rtBuffers = true;
 }
 
 void ThermalTransport::initTransportBuffer(rvk::SingleTimeCommand& _stc, unsigned int _vertex_count)
 {
-	transportBuffer.STC_UploadData(&_stc, transportMatrix.data(), transportMatrix.size() * sizeof(FLOAT), 0);
+	Vec slice = Vec::Zero(glm::max((unsigned int)1, 2 * _vertex_count));
+	transportBuffer.STC_UploadData(&_stc, slice.data(), slice.size() * sizeof(FLOAT), 0);
+	transportSliceVertex = -1;
 }
 
 void ThermalTransport::setAuxiliaryUbo(AuxiliaryUbo& _aux_ubo, unsigned int _vertex_count, unsigned int _ray_count, unsigned int _rayDepth, unsigned int _batchSeed)
@@ -155,6 +233,7 @@ void ThermalTransport::setAuxiliaryUbo(AuxiliaryUbo& _aux_ubo, unsigned int _ver
 	_aux_ubo.rayCount = _ray_count;
 	_aux_ubo.rayDepth = _rayDepth;
 	_aux_ubo.batchSeed = _batchSeed;
+	_aux_ubo.sampler = sampler;
 }
 
 void ThermalTransport::initAuxilaryBuffer(rvk::SingleTimeCommand& _stc, unsigned int _vertex_count, unsigned int _ray_count, unsigned int _rayDepth, unsigned int _batchSeed)
@@ -240,63 +319,483 @@ void ThermalTransport::load(
 	unsigned int triangle_count = _thermalScene.getProperties().triangleCount;
 
 	int n = glm::max((unsigned int)1, vertex_count);
-	transportMatrix = Mat::Constant(n, n, 0.0);
-	spdlog::info("ThermalRenderer: created transport matrix of size {} x {}", n, n);
+	transportMatrix = SpMat(n, n);
+	resetAccumulation(n);
+	spdlog::info("ThermalRenderer: created sparse transport matrix of size {} x {}", n, n);
 
 	if(setup)
-		setupBuffers(vertex_count, triangle_count);
+		setupBuffers(_device, vertex_count, triangle_count);
 
-	initAS(_stc, _device, _gpuBlas, geometryDataBuffer, _scene, _thermalScene);
+	// the tlas and the ray tracing inputs are loaded by loadRayTracing once an estimate is traced on the gpu
+	rtLoaded = false;
+	// the host bvh is built on the first cpu traced batch
+	cpuTracer.clear();
 	initTransportBuffer(_stc, vertex_count);
-	initAuxilaryBuffer(_stc, vertex_count, _ray_count, 0, 0);
+	initKelvinBuffer(_stc, _thermalData, vertex_count);
+}
+
+bool ThermalTransport::loadRayTracing(
+	rvk::SingleTimeCommand& _stc,
+	rvk::LogicalDevice* _device,
+	GeometryDataBlasVulkan& _gpuBlas,
+	rvk::Buffer& geometryDataBuffer,
+	scene_s& _scene,
+	ThermalScene& _thermalScene,
+	ThermalData& _thermalData)
+{
+	if (!rtAvailable)
+		return false;
+	if (rtLoaded)
+		return true;
+
+	unsigned int vertex_count = _thermalScene.getProperties().vertexCount;
+	unsigned int triangle_count = _thermalScene.getProperties().triangleCount;
+
+	// plan before anything is allocated, scenes whose buffers leave no room for the records are traced on the cpu
+	if (!rtBuffers && !planRecordCapacity(_device, vertex_count, triangle_count))
+		return false;
+	if (!rtPipeline)
+		prepare(geometryDataBuffer, _gpuBlas);
+	if (!rtBuffers)
+		setupRayTracingBuffers(_device, vertex_count, triangle_count);
+
+	initAS(_stc, _device, _gpuBlas, geometryDataBuffer, _scene, _thermalScene);
+	initAuxilaryBuffer(_stc, vertex_count, 0, 0, 0);
 	initInstanceBuffer(_stc, _scene, _thermalScene);
 	initTriangleAreaBuffer(_stc, _thermalData, triangle_count);
 	initAbsorptionEmissionBuffers(_stc, _thermalData, vertex_count);
-	initKelvinBuffer(_stc, _thermalData, vertex_count);
 
 	globalDescriptor.update();
+	rtLoaded = true;
+	return true;
+}
+
+void ThermalTransport::accumulateRecords(const std::vector<TransportRecord>& _records, const TriangleIndices& _triangleVertexIndices, unsigned int _vertex_count)
+{
+	if (_records.empty())
+		return;
+
+	// merge repeated (absorber, emitter) triangle pairs before expanding them to vertices
+	std::vector<uint64_t> keys(_records.size());
+	for (size_t i = 0; i < _records.size(); i++)
+		keys[i] = (uint64_t(_records[i].absorberTriangle) << 32) | _records[i].emitterTriangle;
+	std::sort(keys.begin(), keys.end());
+
+	std::vector<Triplet<uint64_t>> triplets;
+	for (size_t i = 0; i < keys.size();)
+	{
+		size_t j = i + 1;
+		while (j < keys.size() && keys[j] == keys[i])
+			j++;
+
+		unsigned int absorber = (unsigned int)(keys[i] >> 32);
+		unsigned int emitter = (unsigned int)(keys[i] & 0xffffffff);
+		uint64_t hits = j - i;
+		// rows are absorbing vertices, columns emitting vertices
+		for (int a = 0; a < 3; a++)
+		{
+			for (int e = 0; e < 3; e++)
+				triplets.emplace_back(_triangleVertexIndices(absorber, a), _triangleVertexIndices(emitter, e), hits);
+			batchRowHits[_triangleVertexIndices(absorber, a)] += 3 * hits;
+		}
+		i = j;
+	}
+
+	SpHitMat chunk(_vertex_count, _vertex_count);
+	chunk.setFromTriplets(triplets.begin(), triplets.end());
+	hitMatrix += chunk;
+}
+
+void ThermalTransport::resetAccumulation(unsigned int _vertex_count)
+{
+	hitMatrix = SpHitMat(_vertex_count, _vertex_count);
+	rowHitMean = Vec::Zero(_vertex_count);
+	rowHitM2 = Vec::Zero(_vertex_count);
+	batchRowHits = HitVec::Zero(_vertex_count);
+	errorRows.resize(0);
+	tracedBatches = 0;
+	triangleRays.clear();
+	triangleRayTotals.resize(0);
+}
+
+void ThermalTransport::allocateRays(const ThermalData& _thermalData, const ThermalObjects& _objects, unsigned int _ray_count, int mode)
+{
+	const unsigned int triangle_count = _thermalData.triangleAreaVector.size();
+	if (triangleRays.size() != triangle_count)
+	{
+		triangleRays.assign(triangle_count, { 0, 0 });
+		triangleRayTotals = HitVec::Zero(triangle_count);
+	}
+	// the rows of fixed vertices do not enter the solve, they are left out of the error estimate
+	errorRows = (_thermalData.fixedVarsVector.array() == 0).cast<SCALAR>().matrix();
+
+	// importance of a triangle is its emitted power, ~ area x emissivity
+	VectorXd weight = _thermalData.triangleAreaVector.cast<double>();
+	if (mode == 0)
+	{
+		for (unsigned int t = 0; t < triangle_count; t++)
+		{
+			auto it = std::upper_bound(_objects.vertexOffset.begin(), _objects.vertexOffset.end(), _thermalData.triangleVertexIndices(t, 0));
+			weight[t] *= _objects.absorption[std::max<std::ptrdiff_t>(0, (it - _objects.vertexOffset.begin()) - 1)];
+		}
+	}
+	const double total = weight.sum();
+	if (!proportionalRays || total <= 0.0)
+	{
+		for (TriangleRaysSSBO& rays : triangleRays)
+			rays.rayCount = _ray_count;
+		return;
+	}
+
+	// same total as the uniform allocation, the minimum first and the rest proportional
+	const unsigned int min_rays = glm::max(minTriangleRays, 1u);
+	const double remaining = glm::max(0.0, double(_ray_count) * triangle_count - double(min_rays) * triangle_count);
+	uint64_t allocated = 0;
+	unsigned int max_rays = 0;
+	for (unsigned int t = 0; t < triangle_count; t++)
+	{
+		const double rays = min_rays + std::round(remaining * weight[t] / total);
+		triangleRays[t].rayCount = (unsigned int)glm::min(rays, double(std::numeric_limits<uint32_t>::max()));
+		allocated += triangleRays[t].rayCount;
+		max_rays = glm::max(max_rays, triangleRays[t].rayCount);
+	}
+	spdlog::info("ThermalTransport: allocated {} rays, {} - {} per triangle", allocated, min_rays, max_rays);
+}
+
+void ThermalTransport::updateStatistics(unsigned int _ray_count)
+{
+	// Welford update of the per batch hit rate (hits per emitted ray) of every absorbing vertex
+	tracedBatches++;
+	for (size_t t = 0; t < triangleRays.size(); t++)
+	{
+		triangleRayTotals[t] += triangleRays[t].rayCount;
+		triangleRays[t].sampleOffset += triangleRays[t].rayCount;
+	}
+	// with proportional allocation the rate is relative to the mean ray count, the relative error does not depend on the scale
+	statisticsRayCount = _ray_count;
+	Vec rate = batchRowHits.cast<SCALAR>() / SCALAR(_ray_count);
+	Vec delta = rate - rowHitMean;
+	rowHitMean += delta / SCALAR(tracedBatches);
+	rowHitM2 += delta.cwiseProduct(rate - rowHitMean);
+	batchRowHits.setZero();
+}
+
+SCALAR ThermalTransport::getRelativeError() const
+{
+	// hit weighted mean of the relative standard errors of the free rows: sum_k se_k / sum_k mean_k
+	// (the worst row never converges, a few rows are hit by single rays), rows below minErrorRowHits are left out
+	if (tracedBatches < 2)
+		return std::numeric_limits<SCALAR>::infinity();
+
+	const double rays = double(statisticsRayCount) * tracedBatches;
+	double error_sum = 0;
+	double mean_sum = 0;
+	for (int k = 0; k < rowHitMean.size(); k++)
+	{
+		if (rowHitMean[k] <= 0 || rowHitMean[k] * rays < minErrorRowHits)
+			continue;
+		if (errorRows.size() == rowHitMean.size() && errorRows[k] == 0)
+			continue;
+		double variance = rowHitM2[k] / double(tracedBatches - 1);
+		error_sum += std::sqrt(variance / double(tracedBatches));
+		mean_sum += rowHitMean[k];
+	}
+	if (mean_sum <= 0)
+		return std::numeric_limits<SCALAR>::infinity();
+	return SCALAR(error_sum / mean_sum);
+}
+
+unsigned int ThermalTransport::launchEnd(unsigned int _first, unsigned int _triangle_count, uint64_t _capacity) const
+{
+	// every ray is absorbed at most once, limiting the rays per launch bounds the record count
+	uint64_t rays = 0;
+	unsigned int last = _first;
+	while (last < _triangle_count && (last == _first || rays + triangleRays[last].rayCount <= _capacity))
+		rays += triangleRays[last++].rayCount;
+	return last;
+}
+
+bool ThermalTransport::finishBatch(unsigned int _ray_count, SCALAR _target_error)
+{
+	updateStatistics(_ray_count);
+	SCALAR error = getRelativeError();
+	if (_target_error > 0 && error <= _target_error)
+	{
+		spdlog::info("\treached relative error {:.3} <= {:.3} after {} batches", error, _target_error, tracedBatches);
+		return true;
+	}
+	return false;
+}
+
+void ThermalTransport::traceBatch(ThermalScene& _thermalScene, ThermalData& _thermalData, unsigned int _ray_depth, unsigned int _batch_seed)
+{
+	unsigned int n = _thermalScene.getProperties().vertexCount;
+	unsigned int triangle_count = glm::min(_thermalScene.getProperties().triangleCount, (unsigned int)triangleRays.size());
+
+	if (!cpuTracer.isBuilt())
+		cpuTracer.build(_thermalData, _thermalScene.getObjects());
+
+	// host memory is not budgeted like the record buffer, the fixed upper bound keeps the record vector small
+	std::vector<TransportRecord> records;
+	for (unsigned int offset = 0; offset < triangle_count;)
+	{
+		unsigned int last = launchEnd(offset, triangle_count, VK_TRANSPORT_RECORD_COUNT);
+		records.clear();
+		cpuTracer.traceTriangles(offset, last - offset, triangleRays, _ray_depth, _batch_seed, records, sampler);
+		accumulateRecords(records, _thermalData.triangleVertexIndices, n);
+		offset = last;
+	}
+}
+
+void ThermalTransport::traceSegments(rvk::SingleTimeCommand& stc, rvk::LogicalDevice* _device, ThermalScene& _thermalScene, ThermalData& _thermalData, unsigned int _batch_count, unsigned int _ray_count, unsigned int _ray_depth, SCALAR _target_error)
+{
+	unsigned int n = _thermalScene.getProperties().vertexCount;
+	unsigned int triangle_count = glm::min(_thermalScene.getProperties().triangleCount, (unsigned int)triangleRays.size());
+	if (triangle_count == 0 || _batch_count == 0)
+		return;
+
+	// launches of one batch, the same for every batch since the allocation is fixed during a refinement
+	std::vector<std::pair<unsigned int, unsigned int>> launches; // first triangle, triangle count
+	std::vector<uint64_t> launch_rays;
+	unsigned int max_rays = 0;
+	for (unsigned int offset = 0; offset < triangle_count;)
+	{
+		unsigned int last = launchEnd(offset, triangle_count, recordCapacity);
+		uint64_t rays = 0;
+		for (unsigned int t = offset; t < last; t++)
+		{
+			rays += triangleRays[t].rayCount;
+			max_rays = glm::max(max_rays, triangleRays[t].rayCount);
+		}
+		launches.emplace_back(offset, last - offset);
+		launch_rays.push_back(rays);
+		offset = last;
+	}
+	if (max_rays > recordCapacity)
+		spdlog::error("Ray count {} exceeds the record buffer capacity {}, records will be dropped!", max_rays, recordCapacity);
+
+	// segments: consecutive launches recorded into one command buffer, whole batches as long as they fit the record buffer
+	typedef struct Segment_s {
+		unsigned int firstBatch;
+		unsigned int batchCount;	// batches ending in this segment
+		unsigned int firstLaunch;	// of the first batch
+		unsigned int launchCount;	// over all its batches
+		uint64_t rays;
+	} Segment_s;
+	std::vector<Segment_s> segments;
+	const uint64_t batch_rays = std::accumulate(launch_rays.begin(), launch_rays.end(), uint64_t(0));
+	if (batch_rays <= recordCapacity)
+	{
+		const unsigned int batches_per_segment = (unsigned int)glm::min(uint64_t(VK_TRANSPORT_SEGMENT_BATCHES), recordCapacity / glm::max(batch_rays, uint64_t(1)));
+		for (unsigned int b = 0; b < _batch_count; b += batches_per_segment)
+		{
+			unsigned int count = glm::min(batches_per_segment, _batch_count - b);
+			segments.push_back({ b, count, 0, count * (unsigned int)launches.size(), count * batch_rays });
+		}
+	}
+	else
+	{
+		for (unsigned int b = 0; b < _batch_count; b++)
+		{
+			for (unsigned int l = 0; l < launches.size();)
+			{
+				Segment_s segment = { b, 0, l, 0, 0 };
+				while (l < launches.size() && (segment.launchCount == 0 || segment.rays + launch_rays[l] <= recordCapacity))
+				{
+					segment.rays += launch_rays[l++];
+					segment.launchCount++;
+				}
+				segment.batchCount = l == launches.size() ? 1 : 0;
+				segments.push_back(segment);
+			}
+		}
+	}
+	spdlog::info("\t{} launches per batch, {} command buffers", launches.size(), segments.size());
+
+	// uniforms, descriptor and sample offsets once, the launches only differ in their push constants
+	AuxiliaryUbo aux_ubo;
+	setAuxiliaryUbo(aux_ubo, n, _ray_count, _ray_depth, tracedBatches);
+	globalUniformBuffer.STC_UploadData(&stc, &aux_ubo, sizeof(AuxiliaryUbo));
+	triangleRayBuffer.STC_UploadData(&stc, triangleRays.data(), triangle_count * sizeof(TriangleRaysSSBO));
+	globalDescriptor.update();
+
+	const unsigned int first_seed = tracedBatches;
+	const VkDeviceSize records_offset = VK_TRANSPORT_SEGMENT_BATCHES * sizeof(uint32_t);
+	rvk::CommandPool* pool = stc.getCommandPool();
+	rvk::Queue* queue = stc.getQueue();
+	rvk::Fence fences[2] = { rvk::Fence(_device), rvk::Fence(_device) };
+	rvk::CommandBuffer* command_buffers[2] = { nullptr, nullptr };
+
+	auto submit = [&](unsigned int _segment) {
+		const Segment_s& segment = segments[_segment];
+		rvk::Buffer& readback = recordReadbackBuffers[_segment % 2];
+		rvk::CommandBuffer* cb = pool->allocCommandBuffers(1).front();
+		cb->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+
+		// the previous segment copies the records before they are reset
+		transportRecordBuffer.CMD_BufferMemoryBarrier(cb, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+		transportRecordBuffer.CMD_FillBuffer(cb, 0, VK_TRANSPORT_RECORD_HEADER_SIZE, 0);
+		transportRecordBuffer.CMD_BufferMemoryBarrier(cb, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+			VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+
+		rt_transport_pipeline.CMD_BindDescriptorSets(cb, { &globalDescriptor });
+		rt_transport_pipeline.CMD_BindPipeline(cb);
+		unsigned int batch_end = 0;
+		for (unsigned int i = 0; i < segment.launchCount; i++)
+		{
+			const unsigned int l = (segment.firstLaunch + i) % launches.size();
+			const unsigned int batch = segment.firstBatch + (segment.firstLaunch + i) / launches.size();
+			TransportPushConstants push_constants = { launches[l].first, first_seed + batch, batch };
+			rt_transport_pipeline.CMD_SetPushConstant(cb, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 0, sizeof(TransportPushConstants), &push_constants);
+			rt_transport_pipeline.CMD_TraceRays(cb, 1, launches[l].second);
+
+			// the record count at the end of every batch separates the batches for the error estimate
+			if (l + 1 == launches.size() && batch_end < segment.batchCount)
+			{
+				transportRecordBuffer.CMD_BufferMemoryBarrier(cb, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, VK_PIPELINE_STAGE_TRANSFER_BIT,
+					VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT, sizeof(uint32_t), 0);
+				transportRecordBuffer.CMD_CopyBuffer(cb, &readback, batch_end++ * sizeof(uint32_t), sizeof(uint32_t), 0);
+				transportRecordBuffer.CMD_BufferMemoryBarrier(cb, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+					VK_ACCESS_TRANSFER_READ_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, sizeof(uint32_t), 0);
+			}
+		}
+
+		// at most one record per ray
+		const VkDeviceSize size = VK_TRANSPORT_RECORD_HEADER_SIZE + glm::min(segment.rays, (uint64_t)recordCapacity) * sizeof(TransportRecord);
+		transportRecordBuffer.CMD_BufferMemoryBarrier(cb, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+		transportRecordBuffer.CMD_CopyBuffer(cb, &readback, records_offset, size, 0);
+		readback.CMD_BufferMemoryBarrier(cb, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_HOST_READ_BIT);
+		cb->end();
+
+		fences[_segment % 2].reset();
+		queue->submitCommandBuffers({ cb }, &fences[_segment % 2]);
+		command_buffers[_segment % 2] = cb;
+	};
+
+	// records of the finished batches, a batch continued in a later segment is only accumulated up to its last finished batch once stopped
+	bool stop = false;
+	std::vector<TransportRecord> records;
+	auto process = [&](unsigned int _segment, bool _stopped) {
+		const Segment_s& segment = segments[_segment];
+		rvk::Buffer& readback = recordReadbackBuffers[_segment % 2];
+		fences[_segment % 2].wait();
+		pool->freeCommandBuffers({ command_buffers[_segment % 2] });
+		command_buffers[_segment % 2] = nullptr;
+
+		const uint8_t* data = readback.getMemoryPointer();
+		const uint32_t* batch_ends = reinterpret_cast<const uint32_t*>(data);
+		const uint32_t* header = reinterpret_cast<const uint32_t*>(data + records_offset);
+		const TransportRecord* segment_records = reinterpret_cast<const TransportRecord*>(data + records_offset + VK_TRANSPORT_RECORD_HEADER_SIZE);
+		if (header[1] > 0)
+			spdlog::error("Transport record buffer overflow, {} records dropped!", header[1]);
+
+		const uint32_t count = glm::min(header[0], (uint32_t)recordCapacity);
+		uint32_t cursor = 0;
+		for (unsigned int b = 0; b < segment.batchCount; b++)
+		{
+			const uint32_t end = glm::min(batch_ends[b], count);
+			records.assign(segment_records + cursor, segment_records + end);
+			accumulateRecords(records, _thermalData.triangleVertexIndices, n);
+			stop = finishBatch(_ray_count, _target_error) || stop;
+			cursor = end;
+		}
+		if (!_stopped && cursor < count)
+		{
+			records.assign(segment_records + cursor, segment_records + count);
+			accumulateRecords(records, _thermalData.triangleVertexIndices, n);
+		}
+	};
+
+	// the host merges the records of a segment while the next one is traced
+	submit(0);
+	for (unsigned int s = 0; s < segments.size(); s++)
+	{
+		const bool stopped = stop;
+		if (!stopped && s + 1 < segments.size())
+			submit(s + 1);
+		else if (stopped && !command_buffers[s % 2])
+			break;
+		process(s, stopped);
+	}
+}
+
+void ThermalTransport::compute(rvk::SingleTimeCommand& stc, rvk::LogicalDevice* _device, ThermalScene& _thermalScene, ThermalData& _thermalData, unsigned int _batch_count, unsigned int _ray_count, unsigned int _ray_depth, int mode, SCALAR _target_error)
+{
+	resetAccumulation(_thermalScene.getProperties().vertexCount);
+	refine(stc, _device, _thermalScene, _thermalData, _batch_count, _ray_count, _ray_depth, mode, _target_error);
 }
 
-void ThermalTransport::compute(rvk::SingleTimeCommand& stc, rvk::LogicalDevice* _device, ThermalScene& _thermalScene, ThermalData& _thermalData, unsigned int _batch_count, unsigned int _ray_count, unsigned int _ray_depth, int mode)
+void ThermalTransport::refine(rvk::SingleTimeCommand& stc, rvk::LogicalDevice* _device, ThermalScene& _thermalScene, ThermalData& _thermalData, unsigned int _batch_count, unsigned int _ray_count, unsigned int _ray_depth, int mode, SCALAR _target_error)
 {
-	spdlog::info("computeTransportMatrix: Spawning threads for {} triangles...", _thermalScene.getProperties().triangleCount);
+	// without a loaded ray tracing pipeline (no device support or memory budget) the host tracer produces the same records
+	const bool cpu_tracing = cpuTracing || !rtLoaded;
+	if (!cpuTracing && !rtLoaded)
+		spdlog::warn("computeTransportMatrix: ray tracing pipeline not available, tracing on the cpu");
+	spdlog::info("computeTransportMatrix: Spawning threads for {} triangles ({})...", _thermalScene.getProperties().triangleCount, cpu_tracing ? "cpu" : "ray tracing pipeline");
 
 	spdlog::stopwatch sw_gpu;
 
-	int n = _thermalScene.getProperties().vertexCount;
+	allocateRays(_thermalData, _thermalScene.getObjects(), _ray_count, mode);
 
-	for (int i = 0; i < _batch_count; i++)
+	if (cpu_tracing)
+	{
+		for (unsigned int i = 0; i < _batch_count; i++)
+		{
+			spdlog::info("\tBatch: {}/{} (total: {}), ray count: {}, ray depth: {} ...", i + 1, _batch_count, tracedBatches + 1, _ray_count, _ray_depth);
+			// continue the seed sequence so appended batches trace new paths, sobol continues from the sample offsets of the triangles
+			// (batches are consecutive parts of one sequence, the error estimate between them is conservative)
+			traceBatch(_thermalScene, _thermalData, _ray_depth, tracedBatches);
+			if (finishBatch(_ray_count, _target_error))
+				break;
+		}
+	}
+	else
 	{
-		spdlog::info("\tBatch: {}/{}, ray count: {}, ray depth: {} ...", i + 1, _batch_count, _ray_count, _ray_depth);
-
-		AuxiliaryUbo aux_ubo;
-		setAuxiliaryUbo(aux_ubo, n, _ray_count, _ray_depth, i);
-		globalUniformBuffer.STC_UploadData(&stc, &aux_ubo, sizeof(AuxiliaryUbo));
-		globalDescriptor.update();
-
-		stc.begin();
-		rt_transport_pipeline.CMD_BindDescriptorSets(stc.buffer(), { &globalDescriptor });
-		rt_transport_pipeline.CMD_BindPipeline(stc.buffer());
-		rt_transport_pipeline.CMD_TraceRays(stc.buffer(), 1, _thermalScene.getProperties().triangleCount);
-		stc.end();
+		spdlog::info("\tBatches: {} (total: {}), ray count: {}, ray depth: {} ...", _batch_count, tracedBatches + _batch_count, _ray_count, _ray_depth);
+		traceSegments(stc, _device, _thermalScene, _thermalData, _batch_count, _ray_count, _ray_depth, _target_error);
 	}
 	_device->waitIdle();
 
 	auto gpu_time = std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(sw_gpu.elapsed()).count() / 1000.0);
-	spdlog::info("\tfinished. (dur.: {:.3} s)", gpu_time);
+	spdlog::info("\tfinished. (dur.: {:.3} s, non-zeros: {}, relative error: {:.3})", gpu_time, hitMatrix.nonZeros(), getRelativeError());
 
 	spdlog::stopwatch sw_cpu;
+	normalize(stc, _thermalData, _thermalScene.getObjects(), mode);
+	spdlog::info("Transport matrix generation dur.: {:.3} s; (GPU: {:.3} s, CPU: {:.3} s,))", sw_gpu, gpu_time, sw_cpu);
+}
 
-	transportBuffer.STC_DownloadData(&stc, transportMatrix.data(), transportMatrix.size() * sizeof(FLOAT));
+void ThermalTransport::normalize(rvk::SingleTimeCommand& stc, ThermalData& _thermalData, const ThermalObjects& _objects, int mode)
+{
+	int n = hitMatrix.rows();
+
+	// every emitted ray removes 3 from the diagonal of each vertex of its triangle
+	VectorXd emitted_rays = VectorXd::Zero(n);
+	for (Index t = 0; t < glm::min(triangleRayTotals.size(), _thermalData.triangleVertexIndices.rows()); t++)
+		for (int c = 0; c < 3; c++)
+			emitted_rays[_thermalData.triangleVertexIndices(t, c)] += 3.0 * triangleRayTotals[t];
+	Vec emitted = emitted_rays.cast<SCALAR>();
+	std::vector<Triplet<SCALAR>> emission;
+	emission.reserve(n);
+	for (int k = 0; k < n; k++)
+		if (emitted[k] > 0.0)
+			emission.emplace_back(k, k, -emitted[k]);
+	SpMat emission_diagonal(n, n);
+	emission_diagonal.setFromTriplets(emission.begin(), emission.end());
+	// counts are exact up to here, converting once keeps the result independent of the batch order
+	reciprocityReport = ReciprocityReport_s();
+	if (reciprocalTransport)
+		transportMatrix = reciprocalHits(hitMatrix.cast<SCALAR>(), emitted, _thermalData, _objects) + emission_diagonal;
+	else
+		transportMatrix = hitMatrix.cast<SCALAR>() + emission_diagonal;
 
 	logEigenBase("solverData.transportMatrix", transportMatrix);
 
-	if (transportMatrix.hasNaN())
+	if (Map<const Vec>(transportMatrix.valuePtr(), transportMatrix.nonZeros()).hasNaN())
 		spdlog::error("Transport matrix has NaN!");
 
-	unsigned int emit_count = _ray_count * _batch_count;
-	for (int k = 0; k < n; k++)
-		transportMatrix.col(k) /= 3.0 * emit_count * _thermalData.vertexTriangleCountVector(k);
+	Vec column_scale = (emitted.array() > 0.0).select(emitted.cwiseInverse(), 0.0);
+	transportMatrix = transportMatrix * column_scale.asDiagonal();
 
 	logEigenBase("solverData.transportMatrix", transportMatrix);
 
@@ -305,25 +804,15 @@ void ThermalTransport::compute(rvk::SingleTimeCommand& stc, rvk::LogicalDevice*
 	spdlog::debug("HINT: columns represent the 'sum' of emitted and distributed factor per node, if sum < 0 some energy is not absorbed, if sum > 0 something is wrong");
 	spdlog::debug("HINT: for closed systems the column sum must be 0");
 	printTransportMatrixSums();
-
-	spdlog::info("transportMatrix:min = {:.2}", transportMatrix.minCoeff());
-	spdlog::info("transportMatrix:avg = {:.2}", transportMatrix.mean());
-	spdlog::info("transportMatrix:max = {:.2}", transportMatrix.maxCoeff());
+	logEigenBase("transportMatrix", transportMatrix);
 #endif // RUNTIME_OPTIMIZED
 
 	if (mode == 0)
 	{
-		// scale rows by emission 
-		for (int k = 0; k < n; k++)
-			transportMatrix.row(k).array() *= _thermalData.emissionVector.array();
+		// scale columns by emission and rows by absorption
+		transportMatrix = _thermalData.absorptionVector.asDiagonal() * transportMatrix * _thermalData.emissionVector.asDiagonal();
 
 		logEigenBase("thermalVars.emissionVector", _thermalData.emissionVector.transpose());
-		logEigenBase("solverData.transportMatrix", transportMatrix);
-
-		// scale columns by absorption 
-		for (int k = 0; k < n; k++)
-			transportMatrix.col(k).array() *= _thermalData.absorptionVector.array();
-
 		logEigenBase("thermalVars.absorptionVector", _thermalData.absorptionVector.transpose());
 		logEigenBase("solverData.transportMatrix", transportMatrix);
 
@@ -331,25 +820,20 @@ void ThermalTransport::compute(rvk::SingleTimeCommand& stc, rvk::LogicalDevice*
 	}
 	else
 	{
-		for (int k = 0; k < n; k++)
-			transportMatrix.row(k).array() *= _thermalData.vertexAreaVector.array();
-
-		for (int k = 0; k < n; k++)
-			transportMatrix.col(k).array() *= 1.0 / _thermalData.vertexAreaVector.array();
+		transportMatrix = _thermalData.vertexAreaVector.cwiseInverse().asDiagonal() * transportMatrix * _thermalData.vertexAreaVector.asDiagonal();
 	}
 
-	spdlog::info("Transport matrix generation dur.: {:.3} s; (GPU: {:.3} s, CPU: {:.3} s,))", sw_gpu, gpu_time, sw_cpu);
+	spdlog::info("Transport matrix non-zeros: {} ({:.3}% of dense, {:.3} MB)", transportMatrix.nonZeros(), 100.0 * double(transportMatrix.nonZeros()) / (double(n) * double(n)),
+		double(transportMatrix.nonZeros() * (sizeof(SCALAR) + sizeof(SpMat::StorageIndex)) + (n + 1) * sizeof(SpMat::StorageIndex)) / (1024.0 * 1024.0));
 	//spdlog::info("Transport matrix condition number ...");
 	//spdlog::info("Transport matrix condition number: {:.3}", condistion_number(transportMatrix));
 
 #ifndef RUNTIME_OPTIMIZED
-	spdlog::info("transportMatrix:min = {:.2}", transportMatrix.minCoeff());
-	spdlog::info("transportMatrix:avg = {:.2}", transportMatrix.mean());
-	spdlog::info("transportMatrix:max = {:.2}", transportMatrix.maxCoeff());
+	logEigenBase("transportMatrix", transportMatrix);
 #endif
 
 #ifndef DISABLE_GUI
-	uploadTransportMatrix(stc, transportMatrix);
+	uploadTransportSlice(stc, glm::max(transportSliceVertex, 0), true);
 #endif
 
 #ifndef RUNTIME_OPTIMIZED
@@ -357,9 +841,103 @@ void ThermalTransport::compute(rvk::SingleTimeCommand& stc, rvk::LogicalDevice*
 #endif // RUNTIME_OPTIMIZED
 }
 
-void ThermalTransport::uploadTransportMatrix(rvk::SingleTimeCommand& stc, const Mat& _transportMatrix)
+SpMat ThermalTransport::reciprocalHits(const SpMat& _hits, const Vec& _emitted, const ThermalData& _thermalData, const ThermalObjects& _objects)
+{
+	const int n = _hits.rows();
+
+	// reciprocity holds between diffusely emitting, traceable surfaces, weighted by area times the absorptivity of the tracer
+	VectorXd weight = VectorXd::Zero(n);
+	for (unsigned int i = 0; i < _objects.count; i++)
+	{
+		const double absorptivity = 1.0 - _objects.diffuseReflectance[i] - _objects.specularReflectance[i];
+		if (!_objects.diffuseEmission[i] || !_objects.traceable[i] || absorptivity <= 0.0)
+			continue;
+		for (unsigned int k = _objects.vertexOffset[i]; k < _objects.vertexOffset[i] + _objects.vertexCount[i]; k++)
+			weight[k] = absorptivity * _thermalData.vertexAreaVector[k];
+	}
+
+	// union of both directions, hits of (i, j) and (j, i)
+	const SpMat transposed = _hits.transpose();
+	const SpMat pairs = _hits + transposed;
+
+	std::vector<Triplet<SCALAR>> triplets;
+	triplets.reserve(pairs.nonZeros());
+	double residual = 0, reciprocal_norm = 0, change = 0, norm = 0, directional_error = 0, reciprocal_error = 0;
+	for (int i = 0; i < n; i++)
+	{
+		SpMat::InnerIterator hit(_hits, i);
+		for (SpMat::InnerIterator pair(pairs, i); pair; ++pair)
+		{
+			const int j = pair.col();
+			while (hit && hit.col() < j)
+				++hit;
+			const double h_ij = (hit && hit.col() == j) ? hit.value() : 0.0;
+
+			double value = h_ij;
+			if (i != j && weight[i] > 0 && weight[j] > 0 && _emitted[i] > 0 && _emitted[j] > 0)
+			{
+				// both counts are poisson with rates S * E_j / w_j and S * E_i / w_i for the shared S = w_j P_ij = w_i P_ji,
+				// the maximum likelihood estimate splits the pooled hits by the exposures, the pair total is kept
+				const double h_ji = pair.value() - h_ij;
+				const double exposure_ij = _emitted[j] * weight[i];
+				const double exposure_ji = _emitted[i] * weight[j];
+				value = pair.value() * exposure_ij / (exposure_ij + exposure_ji);
+
+				const double s_ij = weight[j] * h_ij / _emitted[j];
+				const double s_ji = weight[i] * h_ji / _emitted[i];
+				residual += (s_ij - s_ji) * (s_ij - s_ji);
+				reciprocal_norm += s_ij * s_ij;
+				// relative standard error of a count is 1 / sqrt(hits), averaged with the directional hits as weights
+				directional_error += std::sqrt(h_ij);
+				reciprocal_error += h_ij / std::sqrt(pair.value());
+				reciprocityReport.pairs++;
+			}
+			if (_emitted[j] > 0)
+			{
+				change += (value - h_ij) * (value - h_ij) / (double(_emitted[j]) * _emitted[j]);
+				norm += h_ij * h_ij / (double(_emitted[j]) * _emitted[j]);
+			}
+
+			if (value > 0.0)
+				triplets.emplace_back(i, j, SCALAR(value));
+		}
+	}
+	reciprocityReport.residual = reciprocal_norm > 0 ? SCALAR(std::sqrt(residual / reciprocal_norm)) : 0;
+	reciprocityReport.change = norm > 0 ? SCALAR(std::sqrt(change / norm)) : 0;
+	reciprocityReport.errorRatio = directional_error > 0 ? SCALAR(reciprocal_error / directional_error) : 1;
+	spdlog::info("Reciprocal transport: {} vertex pairs, directional residual {:.3}, change {:.3}, rel. standard error x{:.3} (~{:.3} of the rays for the same error)",
+		reciprocityReport.pairs, reciprocityReport.residual, reciprocityReport.change, reciprocityReport.errorRatio, reciprocityReport.errorRatio * reciprocityReport.errorRatio);
+
+	SpMat result(n, n);
+	result.setFromTriplets(triplets.begin(), triplets.end());
+	return result;
+}
+
+void ThermalTransport::setTransportMatrix(rvk::SingleTimeCommand& stc, SpMat&& _matrix)
+{
+	transportMatrix = std::move(_matrix);
+	resetAccumulation(transportMatrix.rows());
+
+#ifndef DISABLE_GUI
+	uploadTransportSlice(stc, glm::max(transportSliceVertex, 0), true);
+#endif
+}
+
+void ThermalTransport::uploadTransportSlice(rvk::SingleTimeCommand& stc, int _vertex, bool _force)
 {
-	transportBuffer.STC_UploadData(&stc, _transportMatrix.data(), _transportMatrix.size() * sizeof(FLOAT), 0);
+	const int n = transportMatrix.rows();
+	if ((!_force && _vertex == transportSliceVertex) || _vertex < 0 || _vertex >= n)
+		return;
+
+	// [0, n): column of _vertex (emission to all), [n, 2n): row of _vertex (absorption from all)
+	Vec slice = Vec::Zero(2 * n);
+	for (int k = 0; k < n; k++)
+		slice[k] = transportMatrix.coeff(k, _vertex);
+	for (SpMat::InnerIterator it(transportMatrix, _vertex); it; ++it)
+		slice[n + it.col()] = it.value();
+
+	transportBuffer.STC_UploadData(&stc, slice.data(), slice.size() * sizeof(FLOAT), 0);
+	transportSliceVertex = _vertex;
 }
 
 void ThermalTransport::uploadValueVector(rvk::SingleTimeCommand& stc, const Vec& _values)
@@ -369,12 +947,20 @@ void ThermalTransport::uploadValueVector(rvk::SingleTimeCommand& stc, const Vec&
 
 void ThermalTransport::unload()
 {
+	cpuTracer.clear();
 	top.destroy();
 	transportBuffer.destroy();
+	transportRecordBuffer.destroy();
+	for (rvk::Buffer& readback : recordReadbackBuffers)
+		readback.destroy();
 	valueBuffer.destroy();
 	triangleAreaBuffer.destroy();
+	triangleBuffer.destroy();
+	triangleRayBuffer.destroy();
 	vertexEmissionBuffer.destroy();
 	vertexAbsorptionBuffer.destroy();
+	rtBuffers = false;
+	rtLoaded = false;
 }
 
 void ThermalTransport::printTransportMatrixSums()
@@ -384,13 +970,16 @@ void ThermalTransport::printTransportMatrixSums()
 	threshold = FLT_EPSILON;
 	if (spdlog::get_level() >= spdlog::level::debug)
 	{
+		Vec ones = Vec::Ones(transportMatrix.cols());
+		Vec col_sums = transportMatrix.transpose() * ones;
+		Vec row_sums = transportMatrix * ones;
 		for (int k = 0; k < transportMatrix.cols(); k++) {
-			//if (std::abs(transportMatrix.col(k).sum()) > (10.0 * threshold))
-			spdlog::debug("transport column {} sum {}", k, transportMatrix.col(k).sum());
+			//if (std::abs(col_sums[k]) > (10.0 * threshold))
+			spdlog::debug("transport column {} sum {}", k, col_sums[k]);
 		}
 		for (int k = 0; k < transportMatrix.rows(); k++) {
-			//if (std::abs(transportMatrix.row(k).sum()) > (10.0 * threshold))
-			spdlog::debug("transport   row  {} sum {}", k, transportMatrix.row(k).sum());
+			//if (std::abs(row_sums[k]) > (10.0 * threshold))
+			spdlog::debug("transport   row  {} sum {}", k, row_sums[k]);
 		}
 	}
 }
\ No newline at end of file
@@ -14,6 +14,7 @@
 #include "thermal_data.hpp"
 #include "thermal_scene.hpp"
 #include "thermal_objects.hpp"
+#include "thermal_cpu_tracer.hpp"
 
 T_USE_NAMESPACE
 
@@ -23,6 +24,13 @@ class ThermalTransport {
 
 public:
 
+	typedef struct ReciprocityReport_s {
+		unsigned int pairs = 0;	// vertex pairs combined from both directions
+		SCALAR residual = 0;	// ||S - S^T|| / ||S|| of the directional estimate, S = P * diag(area * absorptivity)
+		SCALAR change = 0;		// ||P_reciprocal - P|| / ||P||, P: absorbed fraction of the emitted rays
+		SCALAR errorRatio = 1;	// hit weighted relative standard error of the combined pairs, reciprocal over directional
+	} ReciprocityReport_s;
+
 	ThermalTransport(rvk::LogicalDevice* aDevice) :
 		top(aDevice),
 		instanceDataBuffer(aDevice),
@@ -32,7 +40,11 @@ public:
 		rt_transport_shader(aDevice),
 		rt_transport_pipeline(aDevice),
 		transportBuffer(aDevice),
+		transportRecordBuffer(aDevice),
+		recordReadbackBuffers{ rvk::Buffer(aDevice), rvk::Buffer(aDevice) },
 		triangleAreaBuffer(aDevice),
+		triangleBuffer(aDevice),
+		triangleRayBuffer(aDevice),
 		valueBuffer(aDevice),
 		vertexEmissionBuffer(aDevice),
 		vertexAbsorptionBuffer(aDevice)
@@ -40,11 +52,22 @@ public:
 
 	~ThermalTransport() = default;
 
+	// ray tracing pipeline, created by loadRayTracing
 	void prepare(rvk::Buffer& _geomBuffer, GeometryDataBlasVulkan& _gpuBlas);
 	void load(rvk::SingleTimeCommand& _stc, rvk::LogicalDevice* _device, GeometryDataBlasVulkan& _gpuBlas, rvk::Buffer& geometryDataBuffer, scene_s& _scene, ThermalScene& _thermalScene, ThermalData& _thermalData, unsigned int _batch_count, unsigned int _ray_count, unsigned int _ray_depth, int mode, bool _setup = false);
+	// pipeline, record buffers, tlas and the shader inputs, only needed for gpu traced estimates; false without device support or memory
+	bool loadRayTracing(rvk::SingleTimeCommand& _stc, rvk::LogicalDevice* _device, GeometryDataBlasVulkan& _gpuBlas, rvk::Buffer& geometryDataBuffer, scene_s& _scene, ThermalScene& _thermalScene, ThermalData& _thermalData);
 	void initAS(rvk::SingleTimeCommand& _stc, rvk::LogicalDevice* _device, GeometryDataBlasVulkan& _gpuBlas, rvk::Buffer& geometryDataBuffer, scene_s& _scene, ThermalScene& _thermalScene);
-	void setupBuffers(unsigned int _vertex_count, unsigned int _triangle_count);
-	void compute(rvk::SingleTimeCommand& stc, rvk::LogicalDevice* _device, ThermalScene& _thermalScene, ThermalData& _thermalData, unsigned int batchCount, unsigned int rayCount, unsigned int _ray_depth, int mode);
+	void setupBuffers(rvk::LogicalDevice* _device, unsigned int _vertex_count, unsigned int _triangle_count);
+	// record capacity from the device local and host coherent budgets, false if the scene leaves no room for VK_TRANSPORT_MIN_RECORD_COUNT records
+	bool planRecordCapacity(rvk::LogicalDevice* _device, unsigned int _vertex_count, unsigned int _triangle_count);
+	void setupRayTracingBuffers(rvk::LogicalDevice* _device, unsigned int _vertex_count, unsigned int _triangle_count);
+	// compute restarts the accumulation, refine appends batches to it; both stop early once the relative error reaches _target_error (0 disables)
+	void compute(rvk::SingleTimeCommand& stc, rvk::LogicalDevice* _device, ThermalScene& _thermalScene, ThermalData& _thermalData, unsigned int batchCount, unsigned int rayCount, unsigned int _ray_depth, int mode, SCALAR _target_error = 0);
+	void refine(rvk::SingleTimeCommand& stc, rvk::LogicalDevice* _device, ThermalScene& _thermalScene, ThermalData& _thermalData, unsigned int batchCount, unsigned int rayCount, unsigned int _ray_depth, int mode, SCALAR _target_error = 0);
+	void normalize(rvk::SingleTimeCommand& stc, ThermalData& _thermalData, const ThermalObjects& _objects, int mode);
+	SpMat reciprocalHits(const SpMat& _hits, const Vec& _emitted, const ThermalData& _thermalData, const ThermalObjects& _objects);
+	void setTransportMatrix(rvk::SingleTimeCommand& stc, SpMat&& _matrix);
 	//void recompute(viewDef_s* aViewDef, rvk::SingleTimeCommand& stc, rvk::LogicalDevice* _device, GeometryDataBlasVulkan& _gpuBlas, ThermalScene& _thermalScene, ThermalData& _thermalData, unsigned int batchCount, unsigned int rayCount, int mode);
 
 	void initTransportBuffer(rvk::SingleTimeCommand& _stc, unsigned int _vertex_count);
@@ -56,14 +79,47 @@ public:
 
 	void setAuxiliaryUbo(AuxiliaryUbo& _aux_ubo, unsigned int _vertex_count, unsigned int _ray_count, unsigned int _rayDepth, unsigned int _batchSeed);
 
-	void uploadTransportMatrix(rvk::SingleTimeCommand& stc, const Mat& _transportMatrix);
+	void resetAccumulation(unsigned int _vertex_count);
+	void allocateRays(const ThermalData& _thermalData, const ThermalObjects& _objects, unsigned int _ray_count, int mode);
+	void updateStatistics(unsigned int _ray_count);
+	void accumulateRecords(const std::vector<TransportRecord>& _records, const TriangleIndices& _triangleVertexIndices, unsigned int _vertex_count);
+	unsigned int launchEnd(unsigned int _first, unsigned int _triangle_count, uint64_t _capacity) const;
+	// updates the error estimate, true once _target_error is reached
+	bool finishBatch(unsigned int _ray_count, SCALAR _target_error);
+	void traceBatch(ThermalScene& _thermalScene, ThermalData& _thermalData, unsigned int _ray_depth, unsigned int _batch_seed);
+	// all launches whose records fit the record buffer share one command buffer, the host merges a segment while the next one is traced
+	void traceSegments(rvk::SingleTimeCommand& stc, rvk::LogicalDevice* _device, ThermalScene& _thermalScene, ThermalData& _thermalData, unsigned int _batch_count, unsigned int _ray_count, unsigned int _ray_depth, SCALAR _target_error);
+
+	void uploadTransportSlice(rvk::SingleTimeCommand& stc, int _vertex, bool _force = false);
 	void uploadValueVector(rvk::SingleTimeCommand& stc, const Vec& _values);
 
 	void unload();
 
 	void printTransportMatrixSums();
 
-	const Mat& getTransportMatrix() { return transportMatrix; }
+	const SpMat& getTransportMatrix() { return transportMatrix; }
+	// hit weighted relative standard error of the free rows (inf before two batches)
+	SCALAR getRelativeError() const;
+	unsigned int getTracedBatches() const { return tracedBatches; }
+	const ReciprocityReport_s& getReciprocityReport() const { return reciprocityReport; }
+	bool useRayTracing() const { return rtAvailable && !cpuTracing; }
+	bool isRayTracingLoaded() const { return rtLoaded; }
+
+	// share of the free device local (and host coherent) memory the record buffer (and its readback copies) may use, sized on the first gpu estimate
+	float recordBudgetFraction = 0.5f;
+	// trace on the host (ThermalCpuTracer) instead of the ray tracing pipeline, the records and the normalization are shared
+	bool cpuTracing = false;
+	// false if the device lacks the ray tracing extensions, every estimate is then traced on the host
+	bool rtAvailable = true;
+	// combine the estimates of both directions of every vertex pair using reciprocity (A_i a_i P_ji = A_j a_j P_ij)
+	bool reciprocalTransport = false;
+	// TRANSPORT_SAMPLER_RANDOM or TRANSPORT_SAMPLER_SOBOL (scrambled per triangle, appended batches continue the sequence)
+	unsigned int sampler = TRANSPORT_SAMPLER_RANDOM;
+	// distribute rayCount x triangles over the triangles by area x emissivity (area outside the kelvin mode), at least minTriangleRays each
+	bool proportionalRays = false;
+	unsigned int minTriangleRays = 16;
+	// rows with fewer absorbed hits are too noisy for the relative error estimate
+	unsigned int minErrorRowHits = 16;
 
 	rvk::Buffer& getTransportBuffer() { return transportBuffer; }
 	rvk::Buffer& getKelvinBuffer() { return valueBuffer; }
@@ -75,9 +131,18 @@ private:
 	#define VK_GLOBAL_IMAGE_SIZE 128
 	#define VK_INSTANCE_SIZE 256 * 4
 	#define VK_GEOMETRY_SIZE 256 * 4
+	#define VK_TRANSPORT_RECORD_COUNT 16 * 1024 * 1024 // upper bound, the actual capacity follows the memory budget
+	#define VK_TRANSPORT_MIN_RECORD_COUNT 1024 // below, the gpu estimate falls back to the cpu tracer
+	#define VK_TRANSPORT_RECORD_HEADER_SIZE (2 * sizeof(uint32_t))
+	#define VK_TRANSPORT_SEGMENT_BATCHES 64 // batches per command buffer, their record counts precede the header in the readback
 
 	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
+	// ray tracing state: pipeline created, buffers sized for the scene, tlas and inputs loaded
+	bool												rtPipeline = false;
+	bool												rtBuffers = false;
+	bool												rtLoaded = false;
+
 	// tlas
 	rvk::TopLevelAS										top;
 
@@ -90,13 +155,34 @@ private:
 	rvk::RTShader										rt_transport_shader;
 	rvk::RTPipeline										rt_transport_pipeline;
 
-	rvk::Buffer											transportBuffer;
+	rvk::Buffer											transportBuffer; // column and row of the displayed source vertex
+	rvk::Buffer											transportRecordBuffer;
+	rvk::Buffer											recordReadbackBuffers[2]; // host visible, alternating between the segments in flight
 	rvk::Buffer											triangleAreaBuffer;
+	rvk::Buffer											triangleBuffer; // vertex indices and instance per global triangle
+	rvk::Buffer											triangleRayBuffer; // ray count and sample offset per global triangle
 
 	rvk::Buffer											valueBuffer;
 	rvk::Buffer											vertexEmissionBuffer;
 	rvk::Buffer											vertexAbsorptionBuffer;
 
-	Mat transportMatrix;
+	ThermalCpuTracer									cpuTracer;
+
+	SpMat transportMatrix;
+	int transportSliceVertex = -1;
+	unsigned int recordCapacity = VK_TRANSPORT_RECORD_COUNT;
+
+	// running estimate, unnormalized absorbed hits (rows: absorber, columns: emitter)
+	SpHitMat hitMatrix;
+	HitVec batchRowHits;
+	Vec rowHitMean; // mean hits per ray of each absorbing vertex over all batches
+	Vec rowHitM2;
+	Vec errorRows; // 1 for the rows of free vertices
+	unsigned int statisticsRayCount = 0;
+	unsigned int tracedBatches = 0;
+	std::vector<TriangleRaysSSBO> triangleRays; // allocation of the next batch
+	HitVec triangleRayTotals; // emitted rays per triangle, summed over all batches
+
+	ReciprocityReport_s reciprocityReport;
 
 };
\ No newline at end of file
@@ -45,6 +45,9 @@ public:
 	void					end();
 							// or execute directly
 	void					execute(const std::function<void(CommandBuffer*)>& aFunction);
+							// for asynchronous submissions on the same queue
+	CommandPool*			getCommandPool() const;
+	Queue*					getQueue() const;
 
 private:
 	CommandPool*			mCommandPool;
@@ -130,3 +130,13 @@ void SingleTimeCommand::execute(const std::function<void(CommandBuffer*)>& aFunc
 	aFunction(mCommandBuffer);
 	end();
 }
+
+CommandPool* SingleTimeCommand::getCommandPool() const
+{
+	return mCommandPool;
+}
+
+Queue* SingleTimeCommand::getQueue() const
+{
+	return mQueue;
+}